@@ -0,0 +1,461 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Benchmark driver for drw. Runs fixed workloads against a private Xvfb, or
+ * the memory backend if there is no Xvfb, and reports the median time and X
+ * round trips per operation. Results are printed as text or as JSON with one
+ * result per line, two JSON files can be compared with -c. */
+#define _GNU_SOURCE /* RTLD_NEXT */
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/Xlibint.h>
+#include <X11/extensions/XShm.h>
+#include <X11/Xft/Xft.h>
+
+#include "arg.h"
+#include "drw.h"
+#include "util.h"
+
+#define REPS 5 /* repetitions, the median is reported */
+
+typedef struct {
+	const char *name;
+	void (*run)(unsigned int i);
+	unsigned int iters;
+} Workload;
+
+typedef struct {
+	char name[64];
+	unsigned long iters;
+	double ns, rts;
+} Result;
+
+static uint64_t nsnow(void);
+static int cmpdouble(const void *a, const void *b);
+static Display *startxvfb(void);
+static void stopxvfb(void);
+static void setup(const char *backend);
+static void bench(const Workload *w, Result *r);
+static size_t readresults(const char *path, Result *r, size_t n);
+static void compare(const char *oldpath, const char *newpath);
+static void usage(void);
+static void text_ascii(unsigned int i);
+static void text_xftdraw(unsigned int i);
+static void text_xftkeep(unsigned int i);
+static void text_cjk(unsigned int i);
+static void text_emoji(unsigned int i);
+static void measure_ascii(unsigned int i);
+static void measure_cjk(unsigned int i);
+static void measure_emoji(unsigned int i);
+static void layout_ascii(unsigned int i);
+static void truncate_narrow(unsigned int i);
+static void rect_fill(unsigned int i);
+static void rect_outline(unsigned int i);
+static void resize_storm(unsigned int i);
+static void frame_bar(unsigned int i);
+
+char *argv0;
+
+static const char *fonts[] = { "monospace:size=10" };
+static const char *colors[] = { "#bbb012", "#411828" };
+static const char *ascii = "Today is Saturday, October 17.. ..And is a good day!";
+static const char *cjk = "\xe4\xbb\x8a\xe5\xa4\xa9\xe6\x98\xaf\xe5\xa5\xbd\xe6\x97\xa5\xe5\xad\x90 "
+                         "\xe3\x81\x93\xe3\x82\x93\xe3\x81\xab\xe3\x81\xa1\xe3\x81\xaf "
+                         "\xec\x95\x88\xeb\x85\x95\xed\x95\x98\xec\x84\xb8\xec\x9a\x94";
+static const char *emoji = "ok \xf0\x9f\x98\x80 \xf0\x9f\x8e\x89 \xf0\x9f\x9a\x80 \xe2\x9c\x93 done";
+
+static const Workload workloads[] = {
+	/* name              function          iterations */
+	{ "text_ascii",      text_ascii,       20000 },
+	{ "text_xftdraw",    text_xftdraw,     20000 },
+	{ "text_xftkeep",    text_xftkeep,     20000 },
+	{ "text_cjk",        text_cjk,         20000 },
+	{ "text_emoji",      text_emoji,       20000 },
+	{ "measure_ascii",   measure_ascii,    200000 },
+	{ "measure_cjk",     measure_cjk,      200000 },
+	{ "measure_emoji",   measure_emoji,    200000 },
+	{ "layout_ascii",    layout_ascii,     20000 },
+	{ "truncate_narrow", truncate_narrow,  20000 },
+	{ "rect_fill",       rect_fill,        50000 },
+	{ "rect_outline",    rect_outline,     50000 },
+	{ "resize_storm",    resize_storm,     5000 },
+	{ "frame_bar",       frame_bar,        10000 },
+};
+
+static Display *dpy;
+static unsigned long roundtrips; /* replies waited for, see _XReply */
+static Window win;
+static Drw *drw;
+static pid_t xvfb = -1;
+static unsigned int bw = 800, bh; /* bar geometry */
+
+void
+text_ascii(unsigned int i)
+{
+	drw_text(drw, 0, 0, bw, bh, 4, ascii, 0);
+}
+
+/* The string drawn through an XftDraw set up and torn down around the call,
+ * as drw_text did before Drw kept one, against the one Drw keeps. Xft makes
+ * the Picture on the first draw, so both have to draw. Only the x backend
+ * has a pixmap to draw to. */
+void
+text_xftdraw(unsigned int i)
+{
+	XftDraw *d;
+
+	if (!drw->drawable)
+		return;
+	d = XftDrawCreate(dpy, drw->drawable, DefaultVisual(dpy, DefaultScreen(dpy)),
+	                  DefaultColormap(dpy, DefaultScreen(dpy)));
+	XftDrawStringUtf8(d, &drw->scheme[ColFg], drw->fonts->xfont, 4, bh - 4,
+	                  (const XftChar8 *)ascii, strlen(ascii));
+	XftDrawDestroy(d);
+}
+
+void
+text_xftkeep(unsigned int i)
+{
+	if (!drw->drawable)
+		return;
+	XftDrawStringUtf8(drw->xftdraw, &drw->scheme[ColFg], drw->fonts->xfont, 4, bh - 4,
+	                  (const XftChar8 *)ascii, strlen(ascii));
+}
+
+void
+text_cjk(unsigned int i)
+{
+	drw_text(drw, 0, 0, bw, bh, 4, cjk, 0);
+}
+
+void
+text_emoji(unsigned int i)
+{
+	drw_text(drw, 0, 0, bw, bh, 4, emoji, 0);
+}
+
+void
+measure_ascii(unsigned int i)
+{
+	drw_fontset_getwidth(drw, ascii);
+}
+
+void
+measure_cjk(unsigned int i)
+{
+	drw_fontset_getwidth(drw, cjk);
+}
+
+void
+measure_emoji(unsigned int i)
+{
+	drw_fontset_getwidth(drw, emoji);
+}
+
+/* a different text every time, nothing comes from the layout cache */
+void
+layout_ascii(unsigned int i)
+{
+	char buf[128];
+
+	snprintf(buf, sizeof(buf), "%u %s", i, ascii);
+	drw_text(drw, 0, 0, bw, bh, 4, buf, 0);
+}
+
+/* widths cycle through more values than the layout cache holds */
+void
+truncate_narrow(unsigned int i)
+{
+	drw_text(drw, 0, 0, 8 + i % 97 * 3, bh, 4, ascii, 0);
+}
+
+void
+rect_fill(unsigned int i)
+{
+	drw_rect(drw, i % 64, 0, 64, bh, 1, i & 1);
+}
+
+void
+rect_outline(unsigned int i)
+{
+	drw_rect(drw, i % 64, 0, 64, bh, 0, i & 1);
+}
+
+/* resize to a new width and redraw the whole bar */
+void
+resize_storm(unsigned int i)
+{
+	unsigned int w = 200 + i * 37 % 1800;
+
+	drw_resize(drw, w, bh);
+	drw_text(drw, 0, 0, w, bh, 4, ascii, 0);
+}
+
+/* the work of one xwindow frame: both halves of the bar and the copy */
+void
+frame_bar(unsigned int i)
+{
+	char left[64];
+	time_t t = 1700000000 + i;
+	unsigned int tw;
+
+	strftime(left, sizeof(left), "Today is %A, %B %d %H:%M:%S", gmtime(&t));
+	drw_frame_begin(drw);
+	drw_text(drw, 0, 0, bw / 2, bh, bh / 2, left, 0);
+	tw = drw_fontset_getwidth(drw, "..And is a good day!") + 2;
+	drw_text(drw, bw / 2, 0, bw / 2, bh, bw / 2 - (tw + bh / 2), "..And is a good day!", 0);
+	drw_frame_end(drw);
+	drw_map(drw, win, 0, 0, bw, bh, 0, 0);
+}
+
+/* Xlib, Xft and Xrender wait for every reply in _XReply, which libX11 calls
+ * through its PLT. Defining it here interposes it, so round trips are
+ * counted wherever they come from. */
+Status
+_XReply(Display *d, xReply *rep, int extra, Bool discard)
+{
+	static Status (*real)(Display *, xReply *, int, Bool);
+
+	if (!real && !(*(void **)&real = dlsym(RTLD_NEXT, "_XReply")))
+		die("dlsym _XReply: %s", dlerror());
+	roundtrips++;
+	return real(d, rep, extra, discard);
+}
+
+uint64_t
+nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int
+cmpdouble(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/* Start a private Xvfb, it reports its display number once it accepts
+ * connections. Returns NULL if there is no Xvfb. */
+Display *
+startxvfb(void)
+{
+	char fd[16], name[32], buf[16];
+	int p[2], n;
+
+	if (pipe(p) < 0)
+		die("pipe:");
+	if ((xvfb = fork()) < 0)
+		die("fork:");
+	if (!xvfb) {
+		close(p[0]);
+		snprintf(fd, sizeof(fd), "%d", p[1]);
+		execlp("Xvfb", "Xvfb", "-displayfd", fd, "-screen", "0", "1280x1024x24",
+		       "-nolisten", "tcp", (char *)NULL);
+		_exit(127);
+	}
+	close(p[1]);
+	n = read(p[0], buf, sizeof(buf) - 1);
+	close(p[0]);
+	if (n <= 0) {
+		waitpid(xvfb, NULL, 0);
+		xvfb = -1;
+		return NULL;
+	}
+	buf[n] = '\0';
+	snprintf(name, sizeof(name), ":%d", atoi(buf));
+	return XOpenDisplay(name);
+}
+
+void
+stopxvfb(void)
+{
+	if (xvfb <= 0)
+		return;
+	kill(xvfb, SIGTERM);
+	waitpid(xvfb, NULL, 0);
+}
+
+void
+setup(const char *backend)
+{
+	Clr *scm;
+	int screen;
+
+	if (strcmp(backend, "mem") && !(dpy = startxvfb()))
+		fprintf(stderr, "%s: cannot start Xvfb, using the memory backend\n", argv0);
+	if (dpy) {
+		screen = DefaultScreen(dpy);
+		win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen), 0, 0, bw, 100, 0, 0, 0);
+		XMapWindow(dpy, win);
+		drw = drw_create(dpy, screen, win, bw, 1);
+		if (!strcmp(backend, "shm") && !drw_useshm(drw))
+			fprintf(stderr, "%s: MIT-SHM is not available, using the x backend\n", argv0);
+	} else {
+		drw = drw_create_mem(bw, 1);
+	}
+	if (!(scm = drw_scm_create(drw, colors, LENGTH(colors))))
+		die("cannot create color scheme");
+	drw_setscheme(drw, scm);
+	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
+		die("no fonts could be loaded.");
+	bh = drw->fonts->h + 2;
+	drw_resize(drw, bw, bh);
+}
+
+/* Run a workload REPS times after a warm up, the X server has to finish
+ * the requests of each repetition. */
+void
+bench(const Workload *w, Result *r)
+{
+	double ns[REPS], rts[REPS];
+	uint64_t start;
+	unsigned long rt;
+	unsigned int i, rep;
+
+	for (i = 0; i < w->iters / 10; i++)
+		w->run(i);
+	drw_sync(drw);
+	for (rep = 0; rep < REPS; rep++) {
+		rt = roundtrips;
+		start = nsnow();
+		for (i = 0; i < w->iters; i++)
+			w->run(i);
+		drw_sync(drw);
+		ns[rep] = (double)(nsnow() - start) / w->iters;
+		/* the closing sync is not part of the workload */
+		rts[rep] = (double)(roundtrips - rt - (dpy != NULL)) / w->iters;
+	}
+	qsort(ns, REPS, sizeof(double), cmpdouble);
+	snprintf(r->name, sizeof(r->name), "%s", w->name);
+	r->iters = w->iters;
+	r->ns = ns[REPS / 2];
+	r->rts = rts[REPS / 2];
+	drw_resize(drw, bw, bh);
+}
+
+/* Read results written with -j, one result per line. */
+size_t
+readresults(const char *path, Result *r, size_t n)
+{
+	FILE *fp;
+	char line[256];
+	size_t i = 0;
+
+	if (!(fp = fopen(path, "r")))
+		die("fopen '%s':", path);
+	while (i < n && fgets(line, sizeof(line), fp))
+		if (sscanf(line, " {\"name\": \"%63[^\"]\", \"iters\": %lu, \"ns_per_op\": %lf, "
+		           "\"roundtrips_per_op\": %lf", r[i].name, &r[i].iters, &r[i].ns, &r[i].rts) == 4)
+			i++;
+	fclose(fp);
+	return i;
+}
+
+void
+compare(const char *oldpath, const char *newpath)
+{
+	Result old[64], new[64];
+	size_t i, j, nold, nnew;
+
+	nold = readresults(oldpath, old, LENGTH(old));
+	nnew = readresults(newpath, new, LENGTH(new));
+	printf("%-16s %12s %12s %8s %10s %10s\n", "workload", "old ns/op", "new ns/op",
+	       "delta", "old rt/op", "new rt/op");
+	for (i = 0; i < nnew; i++) {
+		for (j = 0; j < nold && strcmp(old[j].name, new[i].name); j++)
+			;
+		if (j == nold) {
+			printf("%-16s %12s %12.1f %8s %10s %10.4f\n", new[i].name, "-",
+			       new[i].ns, "-", "-", new[i].rts);
+			continue;
+		}
+		printf("%-16s %12.1f %12.1f %+7.1f%% %10.4f %10.4f\n", new[i].name, old[j].ns,
+		       new[i].ns, (new[i].ns - old[j].ns) / old[j].ns * 100, old[j].rts, new[i].rts);
+	}
+}
+
+void
+usage(void)
+{
+	die("usage: %s [-j] [-b x|shm|mem] [workload ...]\n"
+	    "       %s -c old.json new.json", argv0, argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	Result r;
+	const char *backend = "x";
+	unsigned int i;
+	int j, cmp = 0, json = 0, first = 1;
+
+	ARGBEGIN {
+	case 'b':
+		backend = EARGF(usage());
+		if (strcmp(backend, "x") && strcmp(backend, "shm") && strcmp(backend, "mem"))
+			usage();
+		break;
+	case 'c':
+		cmp = 1;
+		break;
+	case 'j':
+		json = 1;
+		break;
+	default:
+		usage();
+		break;
+	} ARGEND
+
+	if (cmp) {
+		if (argc != 2)
+			usage();
+		compare(argv[0], argv[1]);
+		return EXIT_SUCCESS;
+	}
+
+	setup(backend);
+	if (json)
+		printf("{\"backend\": \"%s\", \"results\": [\n", dpy ? backend : "mem");
+	else
+		printf("# backend %s, %d repetitions, median\n%-16s %10s %12s %12s\n",
+		       dpy ? backend : "mem", REPS, "workload", "iters", "ns/op", "rt/op");
+	for (i = 0; i < LENGTH(workloads); i++) {
+		for (j = 0; j < argc && strcmp(argv[j], workloads[i].name); j++)
+			;
+		if (argc && j == argc)
+			continue;
+		bench(&workloads[i], &r);
+		if (json)
+			printf("%s{\"name\": \"%s\", \"iters\": %lu, \"ns_per_op\": %.1f, "
+			       "\"roundtrips_per_op\": %.4f}", first ? "" : ",\n", r.name, r.iters, r.ns, r.rts);
+		else
+			printf("%-16s %10lu %12.1f %12.4f\n", r.name, r.iters, r.ns, r.rts);
+		fflush(stdout);
+		first = 0;
+	}
+	if (json)
+		printf("\n]}\n");
+
+	drw_free(drw);
+	if (dpy) {
+		XDestroyWindow(dpy, win);
+		XCloseDisplay(dpy);
+	}
+	stopxvfb();
+
+	return EXIT_SUCCESS;
+}
@@ -1,9 +1,18 @@
 /* See LICENSE file for copyright and license details. */
 
 static int showbar         = 1;          /* 0 means no bar */
+/* render client side with MIT-SHM if available, its glyphs ignore the
+ * fontconfig antialias, hinting, subpixel and embolden settings */
+static int useshm          = 0;
 static const int winwidth  = 800;        /* default window width */
 static const int winheight = 600;        /* default window height */
 static const char *fonts[] = { "monospace" };
+static const unsigned int fallbackfonts = 8;        /* max open fallback fonts */
+static const size_t fallbackmem = 32 * 1024 * 1024; /* max fallback font bytes */
+static const size_t streammax = 64 * 1024 * 1024;  /* max buffered bytes of a stream */
+static const unsigned int maxfps = 60;               /* max frames per second for -f records */
+static const unsigned int statsinterval = 0;        /* seconds between stats lines on stderr, 0 for none */
+static const char *timefmt = "Today is %A, %B %d.."; /* strftime(3) bar text */
 
 static const char *colors[][3] = {
       			/*  fg       bg     */
@@ -16,12 +25,21 @@ static Shortcut shortcuts[] = {
 	{ XK_Escape,      quit,           {0} },
 	{ XK_q,           quit,           {0} },
 	{ XK_b,           togglebar,      {0} },
+	{ XK_j,           scroll,         {.i = +1} },
+	{ XK_k,           scroll,         {.i = -1} },
+	{ XK_Down,        scroll,         {.i = +1} },
+	{ XK_Up,          scroll,         {.i = -1} },
+	{ XK_space,       scrollpage,     {.i = +1} },
+	{ XK_Next,        scrollpage,     {.i = +1} },
+	{ XK_Prior,       scrollpage,     {.i = -1} },
+	{ XK_Home,        scrollto,       {.i = 0} },
+	{ XK_End,         scrollto,       {.i = -1} },
 };
 
 static Mousekey mshortcuts[] = {
 	/* button         function        argument */
 	//{ Button1,        quit,        {0} },
 	{ Button3,        quit,        {0} },
-	//{ Button4,        quit,        {0} },
-	//{ Button5,        quit,        {0} },
+	{ Button4,        scroll,      {.i = -3} },
+	{ Button5,        scroll,      {.i = +3} },
 };
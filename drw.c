@@ -1,8 +1,14 @@
 /* See LICENSE file for copyright and license details. */
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
 #include <X11/Xft/Xft.h>
 
 #include "drw.h"
@@ -10,19 +16,42 @@
 
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
+#define GLYPHCACHE  256
+#define ARENAALIGN  sizeof(void *) /* TextRun holds a pointer and ints */
 
-static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static const long utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
 static const long utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
+/* utfmask index of a byte by its top five bits, UTF_SIZ + 1 if none matches */
+static const unsigned char utftype[32] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 3, 3, 4, 5
+};
+
+/* fontcache marker for codepoints no font on the system has */
+static Fnt nofont;
+static Fnt *xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern);
+
+static void fallback_flush(Drw *drw);
+static void runcache_flush(RunCache *rc);
+static void runcache_drop(RunCache *rc, Fnt *font);
+
+/* FNV-1a */
+static unsigned long
+strhash(const char *s)
+{
+	unsigned long h = 2166136261UL;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619UL;
+	return h;
+}
 
 static long
 utf8decodebyte(const char c, size_t *i)
 {
-	for (*i = 0; *i < (UTF_SIZ + 1); ++(*i))
-		if (((unsigned char)c & utfmask[*i]) == utfbyte[*i])
-			return (unsigned char)c & ~utfmask[*i];
-	return 0;
+	*i = utftype[(unsigned char)c >> 3];
+	return *i < UTF_SIZ + 1 ? (unsigned char)c & ~utfmask[*i] : 0;
 }
 
 static size_t
@@ -44,6 +73,10 @@ utf8decode(const char *c, long *u, size_t clen)
 	*u = UTF_INVALID;
 	if (!clen)
 		return 0;
+	if (!((unsigned char)c[0] & 0x80)) {
+		*u = c[0];
+		return 1;
+	}
 	udecoded = utf8decodebyte(c[0], &len);
 	if (!BETWEEN(len, 1, UTF_SIZ))
 		return 1;
@@ -60,6 +93,710 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+/* Return the number of leading printable ASCII bytes of the n bytes at s.
+ * Whole words are tested for bytes outside 0x20-0x7e at once, the rest byte
+ * by byte. */
+static size_t
+utf8printlen(const char *s, size_t n)
+{
+	const unsigned long ones = ~0UL / 0xff, highs = ones * 0x80;
+	const char *p = s, *end = s + n;
+	unsigned long v;
+
+	for (; (size_t)(end - p) >= sizeof(v); p += sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		/* bytes below 0x20, 0x7f and above 0x7f */
+		if ((((v - ones * 0x20) & ~v) | ((v ^ ones * 0x7f) - ones) | v) & highs)
+			break;
+	}
+	for (; p < end && BETWEEN(*p, 0x20, 0x7e); p++)
+		; /* NOP */
+	return p - s;
+}
+
+static FT_Face
+font_lockface(Fnt *font)
+{
+	return font->xfont ? XftLockFace(font->xfont) : font->face;
+}
+
+static void
+font_unlockface(Fnt *font)
+{
+	if (font->xfont)
+		XftUnlockFace(font->xfont);
+}
+
+static int
+font_has(Fnt *font, long cp)
+{
+	if (font->xfont)
+		return XftCharExists(font->dpy, font->xfont, cp);
+	return FT_Get_Char_Index(font->face, cp) != 0;
+}
+
+static FT_UInt
+font_index(Fnt *font, long cp)
+{
+	if (font->xfont)
+		return XftCharIndex(font->dpy, font->xfont, cp);
+	return FT_Get_Char_Index(font->face, cp);
+}
+
+/* Return the rasterized glyph, rendered with the FreeType face Xft configured
+ * for the font or the face of a headless font. The advance of Xft fonts is
+ * taken from Xft, so software rendering places glyphs like Xft does. */
+static GlyphImg *
+font_glyph(Fnt *font, FT_UInt index)
+{
+	XGlyphInfo ext;
+	FT_Face face;
+	FT_Bitmap *bm;
+	GlyphImg *g;
+	unsigned int i, j;
+
+	if (!font->glyphs)
+		font->glyphs = ecalloc(GLYPHCACHE, sizeof(GlyphImg));
+	g = &font->glyphs[index % GLYPHCACHE];
+	if (g->index == index + 1)
+		return g;
+
+	free(g->alpha);
+	memset(g, 0, sizeof(*g));
+	g->index = index + 1;
+	if (font->xfont) {
+		XftGlyphExtents(font->dpy, font->xfont, &index, 1, &ext);
+		g->adv = ext.xOff;
+	}
+	if (!(face = font_lockface(font)))
+		return g;
+	if (!FT_Load_Glyph(face, index, FT_LOAD_DEFAULT) &&
+	    !FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL)) {
+		if (!font->xfont)
+			g->adv = (face->glyph->advance.x + 32) >> 6;
+		bm = &face->glyph->bitmap;
+		g->left = face->glyph->bitmap_left;
+		g->top = face->glyph->bitmap_top;
+		g->w = bm->width;
+		g->h = bm->rows;
+		g->alpha = ecalloc(MAX(g->w * g->h, 1), 1);
+		for (j = 0; j < g->h; j++) {
+			for (i = 0; i < g->w; i++) {
+				if (bm->pixel_mode == FT_PIXEL_MODE_MONO)
+					g->alpha[j * g->w + i] = (bm->buffer[j * bm->pitch + i / 8] & (0x80 >> i % 8)) ? 0xff : 0;
+				else
+					g->alpha[j * g->w + i] = bm->buffer[j * bm->pitch + i];
+			}
+		}
+	}
+	font_unlockface(font);
+	return g;
+}
+
+static int
+font_advance(Fnt *font, FT_UInt index)
+{
+	XGlyphInfo ext;
+
+	if (font->xfont) {
+		XftGlyphExtents(font->dpy, font->xfont, &index, 1, &ext);
+		return ext.xOff;
+	}
+	return font_glyph(font, index)->adv;
+}
+
+static void
+fontcache_clear(FntCache *fc)
+{
+	memset(fc->ascii, 0, sizeof(fc->ascii));
+	if (fc->tab)
+		memset(fc->tab, 0, fc->size * sizeof(FntCacheEnt));
+	fc->len = 0;
+	fc->asciifont = NULL;
+	fc->asciichecked = 0;
+	fc->gen++;
+}
+
+static void
+fontcache_insert(FntCache *fc, long cp, Fnt *font)
+{
+	FntCacheEnt *old;
+	size_t i, oldsize;
+
+	if (cp >= 0 && cp < (long)LENGTH(fc->ascii)) {
+		fc->ascii[cp] = font;
+		return;
+	}
+	/* keep the open addressed table at most half full */
+	if (2 * (fc->len + 1) > fc->size) {
+		old = fc->tab;
+		oldsize = fc->size;
+		fc->size = oldsize ? oldsize * 2 : 64;
+		fc->tab = ecalloc(fc->size, sizeof(FntCacheEnt));
+		fc->len = 0;
+		for (i = 0; i < oldsize; i++)
+			if (old[i].font)
+				fontcache_insert(fc, old[i].cp, old[i].font);
+		free(old);
+	}
+	for (i = cp & (fc->size - 1); fc->tab[i].font && fc->tab[i].cp != cp; i = (i + 1) & (fc->size - 1))
+		; /* NOP */
+	if (!fc->tab[i].font)
+		fc->len++;
+	fc->tab[i].cp = cp;
+	fc->tab[i].font = font;
+}
+
+/* Forget the codepoints resolved to a font, the others stay cached. The
+ * table is rebuilt, open addressing has no simple removal. */
+static void
+fontcache_drop(FntCache *fc, Fnt *font)
+{
+	FntCacheEnt *old = fc->tab;
+	size_t i, oldsize = fc->size;
+
+	for (i = 0; i < LENGTH(fc->ascii); i++)
+		if (fc->ascii[i] == font)
+			fc->ascii[i] = NULL;
+	if (fc->asciifont == font) {
+		fc->asciifont = NULL;
+		fc->asciichecked = 0;
+	}
+	if (!old)
+		return;
+	fc->tab = ecalloc(oldsize, sizeof(FntCacheEnt));
+	fc->len = 0;
+	for (i = 0; i < oldsize; i++)
+		if (old[i].font && old[i].font != font)
+			fontcache_insert(fc, old[i].cp, old[i].font);
+	free(old);
+}
+
+static Fnt *
+fontcache_get(FntCache *fc, long cp)
+{
+	size_t i;
+
+	if (cp >= 0 && cp < (long)LENGTH(fc->ascii))
+		return fc->ascii[cp];
+	if (!fc->len)
+		return NULL;
+	for (i = cp & (fc->size - 1); fc->tab[i].font; i = (i + 1) & (fc->size - 1))
+		if (fc->tab[i].cp == cp)
+			return fc->tab[i].font;
+	return NULL;
+}
+
+/* Open the next font of the fontset not opened yet and append it after last.
+ * Returns NULL once all fonts are open. */
+static Fnt *
+fontset_load(Drw *drw, Fnt *last)
+{
+	Fnt *set = drw->fonts, *font;
+
+	while (last && set->npending) {
+		set->npending--;
+		if ((font = xfont_create(drw, *set->pending++, NULL))) {
+			last->next = font;
+			return font;
+		}
+	}
+	return NULL;
+}
+
+/* Return the first font of the set containing the codepoint, or NULL if no
+ * loaded font has it. Codepoints known to have no font at all are drawn with
+ * the primary font. */
+static Fnt *
+fontcache_lookup(Drw *drw, long cp)
+{
+	Fnt *font, *last = NULL;
+	unsigned int i;
+
+	if ((font = fontcache_get(&drw->fcache, cp))) {
+		drw->fcache.hits++;
+		if (font == &nofont) {
+			drw->fcache.nofont++;
+			return drw->fonts;
+		}
+		font->lastused = ++drw->fontclock;
+		return font;
+	}
+	drw->fcache.misses++;
+	/* the fontset takes precedence over fallback fonts, open it up to here */
+	for (font = drw->fonts; font || (font = fontset_load(drw, last)); font = font->next) {
+		last = font;
+		if (font_has(font, cp)) {
+			fontcache_insert(&drw->fcache, cp, font);
+			return font;
+		}
+	}
+	for (i = 0; i < drw->nfallback; i++) {
+		font = drw->fallback[i];
+		if (font_has(font, cp)) {
+			font->lastused = ++drw->fontclock;
+			fontcache_insert(&drw->fcache, cp, font);
+			return font;
+		}
+	}
+	return NULL;
+}
+
+/* Return the font all of printable ASCII resolves to, or NULL if it is spread
+ * over several fonts. */
+static Fnt *
+fontcache_asciifont(Drw *drw)
+{
+	FntCache *fc = &drw->fcache;
+	long cp;
+
+	if (!fc->asciichecked) {
+		fc->asciichecked = 1;
+		fc->asciifont = fontcache_lookup(drw, 0x20);
+		for (cp = 0x21; cp <= 0x7e && fc->asciifont; cp++)
+			if (fontcache_lookup(drw, cp) != fc->asciifont)
+				fc->asciifont = NULL;
+	}
+	return fc->asciifont;
+}
+
+/* The X backend renders into a server side pixmap through core requests and
+ * Xft. */
+static int
+x_resize(Drw *drw)
+{
+	if (drw->drawable)
+		XFreePixmap(drw->dpy, drw->drawable);
+	drw->drawable = XCreatePixmap(drw->dpy, drw->root, drw->pw, drw->ph,
+	                              DefaultDepth(drw->dpy, drw->screen));
+	if (drw->xftdraw)
+		XftDrawChange(drw->xftdraw, drw->drawable);
+	else
+		drw->xftdraw = XftDrawCreate(drw->dpy, drw->drawable,
+		                             DefaultVisual(drw->dpy, drw->screen),
+		                             DefaultColormap(drw->dpy, drw->screen));
+	return 1;
+}
+
+static void
+x_free(Drw *drw)
+{
+	if (drw->xftdraw)
+		XftDrawDestroy(drw->xftdraw);
+	if (drw->drawable)
+		XFreePixmap(drw->dpy, drw->drawable);
+	drw->xftdraw = NULL;
+	drw->drawable = 0;
+}
+
+/* Return the server side size of the backing pixmap in bytes. */
+static size_t
+x_size(Drw *drw)
+{
+	XPixmapFormatValues *fmt;
+	int i, n, depth, bpp;
+
+	depth = DefaultDepth(drw->dpy, drw->screen);
+	bpp = depth;
+	if ((fmt = XListPixmapFormats(drw->dpy, &n))) {
+		for (i = 0; i < n; i++)
+			if (fmt[i].depth == depth)
+				bpp = fmt[i].bits_per_pixel;
+		XFree(fmt);
+	}
+	return (size_t)drw->pw * drw->ph * bpp / 8;
+}
+
+static void *
+batch_scratch(Drw *drw, size_t size)
+{
+	if (size > drw->scratchsize) {
+		drw->scratchsize = size;
+		drw->scratch = erealloc(drw->scratch, size);
+	}
+	return drw->scratch;
+}
+
+static int
+rect_cmp(const void *a, const void *b)
+{
+	unsigned long pa = ((const DrawRect *)a)->pixel, pb = ((const DrawRect *)b)->pixel;
+
+	return (pa > pb) - (pa < pb);
+}
+
+static int
+glyph_cmp(const void *a, const void *b)
+{
+	const DrawGlyph *ga = a, *gb = b;
+	uintptr_t fa = (uintptr_t)ga->spec.font, fb = (uintptr_t)gb->spec.font;
+
+	if (ga->col->pixel != gb->col->pixel)
+		return (ga->col->pixel > gb->col->pixel) - (ga->col->pixel < gb->col->pixel);
+	return (fa > fb) - (fa < fb);
+}
+
+/* Emit the queued commands, rectangles first. Commands are sorted by color
+ * and font so each color costs one request. Queueing flushes early whenever
+ * the reordering would change the result. */
+static void
+x_flush(Drw *drw)
+{
+	XRectangle *xr;
+	XftGlyphFontSpec *gs;
+	unsigned int i, j, n;
+
+	if (drw->nrects) {
+		qsort(drw->rects, drw->nrects, sizeof(DrawRect), rect_cmp);
+		xr = batch_scratch(drw, drw->nrects * sizeof(XRectangle));
+		for (i = 0; i < drw->nrects; i = j) {
+			for (j = i, n = 0; j < drw->nrects && drw->rects[j].pixel == drw->rects[i].pixel; j++)
+				xr[n++] = drw->rects[j].r;
+			XSetForeground(drw->dpy, drw->gc, drw->rects[i].pixel);
+			XFillRectangles(drw->dpy, drw->drawable, drw->gc, xr, n);
+			drw->batchreqs++;
+		}
+	}
+	if (drw->nglyphs) {
+		qsort(drw->glyphs, drw->nglyphs, sizeof(DrawGlyph), glyph_cmp);
+		gs = batch_scratch(drw, drw->nglyphs * sizeof(XftGlyphFontSpec));
+		for (i = 0; i < drw->nglyphs; i = j) {
+			for (j = i, n = 0; j < drw->nglyphs && drw->glyphs[j].col->pixel == drw->glyphs[i].col->pixel; j++)
+				gs[n++] = drw->glyphs[j].spec;
+			XftDrawGlyphFontSpec(drw->xftdraw, drw->glyphs[i].col, gs, n);
+			drw->batchreqs++;
+		}
+	}
+	drw->batchcmds += drw->nrects + drw->nglyphs;
+	drw->nrects = drw->nglyphs = 0;
+	drw->textbox.width = 0;
+}
+
+static int
+intersects(XRectangle *r, int x, int y, unsigned int w, unsigned int h)
+{
+	return r->width && x < r->x + r->width && r->x < x + (int)w &&
+	       y < r->y + r->height && r->y < y + (int)h;
+}
+
+static void
+x_fill(Drw *drw, int x, int y, unsigned int w, unsigned int h, Clr *col)
+{
+	DrawRect *r;
+	unsigned int i;
+
+	if (!drw->batch) {
+		XSetForeground(drw->dpy, drw->gc, col->pixel);
+		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
+		return;
+	}
+
+	/* rectangles are drawn before text and sorted by color */
+	if (intersects(&drw->textbox, x, y, w, h)) {
+		x_flush(drw);
+	} else {
+		for (i = 0; i < drw->nrects; i++) {
+			if (drw->rects[i].pixel != col->pixel &&
+			    intersects(&drw->rects[i].r, x, y, w, h)) {
+				x_flush(drw);
+				break;
+			}
+		}
+	}
+	if (drw->nrects == drw->rectsize) {
+		drw->rectsize = MAX(16, drw->rectsize * 2);
+		drw->rects = erealloc(drw->rects, drw->rectsize * sizeof(DrawRect));
+	}
+	r = &drw->rects[drw->nrects++];
+	r->pixel = col->pixel;
+	r->r.x = x;
+	r->r.y = y;
+	r->r.width = w;
+	r->r.height = h;
+}
+
+static void
+x_text(Drw *drw, Fnt *font, Clr *col, int x, int y, const char *text, unsigned int len)
+{
+	DrawGlyph *g;
+	XRectangle *box = &drw->textbox;
+	unsigned int n;
+	int x0 = x, y0 = y - font->ascent, x1, y1;
+	long cp;
+
+	if (!drw->batch) {
+		XftDrawStringUtf8(drw->xftdraw, col, font->xfont, x, y, (XftChar8 *)text, len);
+		return;
+	}
+
+	for (; len; text += n, len -= n) {
+		n = utf8decode(text, &cp, UTF_SIZ);
+		if (drw->nglyphs == drw->glyphsize) {
+			drw->glyphsize = MAX(64, drw->glyphsize * 2);
+			drw->glyphs = erealloc(drw->glyphs, drw->glyphsize * sizeof(DrawGlyph));
+		}
+		g = &drw->glyphs[drw->nglyphs++];
+		g->col = col;
+		g->spec.font = font->xfont;
+		g->spec.glyph = font_index(font, cp);
+		g->spec.x = x;
+		g->spec.y = y;
+		x += font_advance(font, g->spec.glyph);
+	}
+
+	/* grow the area later rectangles must not be drawn over */
+	x1 = MAX(x, x0 + 1);
+	y1 = y0 + font->h;
+	if (box->width) {
+		x0 = MIN(x0, box->x);
+		y0 = MIN(y0, box->y);
+		x1 = MAX(x1, box->x + box->width);
+		y1 = MAX(y1, box->y + box->height);
+	}
+	box->x = x0;
+	box->y = y0;
+	box->width = x1 - x0;
+	box->height = y1 - y0;
+}
+
+static void
+x_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h, int dx, int dy)
+{
+	x_flush(drw);
+	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, dx, dy);
+}
+
+/* Software rendering into the 32 bit framebuffer of the MIT-SHM and memory
+ * backends. */
+static void
+sw_fill(Drw *drw, int x, int y, unsigned int w, unsigned int h, Clr *col)
+{
+	uint32_t *row;
+	int i, j, x1, y1;
+
+	x1 = MIN(x + (int)w, (int)drw->pw);
+	y1 = MIN(y + (int)h, (int)drw->ph);
+	x = MAX(x, 0);
+	y = MAX(y, 0);
+	for (j = y; j < y1; j++) {
+		row = (uint32_t *)(drw->fb + j * drw->stride);
+		for (i = x; i < x1; i++)
+			row[i] = col->pixel;
+	}
+}
+
+/* Draw UTF-8 text with its baseline at y. */
+static void
+sw_text(Drw *drw, Fnt *font, Clr *col, int x, int y, const char *text, unsigned int len)
+{
+	GlyphImg *g;
+	uint32_t *px;
+	unsigned int a, c, i, j, n;
+	unsigned int r = col->color.red >> 8, gr = col->color.green >> 8, b = col->color.blue >> 8;
+	int gx, gy;
+	long cp;
+
+	for (; len; text += n, len -= n) {
+		n = utf8decode(text, &cp, UTF_SIZ);
+		g = font_glyph(font, font_index(font, cp));
+		for (j = 0; j < g->h; j++) {
+			gy = y - g->top + j;
+			if (gy < 0 || gy >= (int)drw->ph)
+				continue;
+			px = (uint32_t *)(drw->fb + gy * drw->stride);
+			for (i = 0; i < g->w; i++) {
+				gx = x + g->left + i;
+				if (gx < 0 || gx >= (int)drw->pw || !(a = g->alpha[j * g->w + i]))
+					continue;
+				c = px[gx];
+				px[gx] = (c & 0xff000000) |
+				         ((r * a + (c >> 16 & 0xff) * (255 - a)) / 255) << 16 |
+				         ((gr * a + (c >> 8 & 0xff) * (255 - a)) / 255) << 8 |
+				         ((b * a + (c & 0xff) * (255 - a)) / 255);
+			}
+		}
+		x += g->adv;
+	}
+}
+
+/* The MIT-SHM backend renders in software into a shared memory image the
+ * server copies from. */
+static int shmerror;
+
+static int
+shm_xerror(Display *dpy, XErrorEvent *ee)
+{
+	shmerror = 1;
+	return 0;
+}
+
+/* Create the shared memory image in the pixmap size. Only 32 bit TrueColor
+ * images with 8 bits per component in host byte order are supported, that
+ * covers about every local X server. */
+static int
+shm_create(Drw *drw)
+{
+	Visual *visual = DefaultVisual(drw->dpy, drw->screen);
+	XErrorHandler xerror;
+	XImage *img;
+	unsigned int one = 1;
+
+	if (visual->class != TrueColor || visual->red_mask != 0xff0000 ||
+	    visual->green_mask != 0xff00 || visual->blue_mask != 0xff)
+		return 0;
+	if (!(img = XShmCreateImage(drw->dpy, visual, DefaultDepth(drw->dpy, drw->screen),
+	                            ZPixmap, NULL, &drw->shm, drw->pw, drw->ph)))
+		return 0;
+	if (img->bits_per_pixel != 32 ||
+	    img->byte_order != (*(unsigned char *)&one ? LSBFirst : MSBFirst) ||
+	    (drw->shm.shmid = shmget(IPC_PRIVATE, img->bytes_per_line * img->height,
+	                             IPC_CREAT | 0600)) < 0) {
+		XDestroyImage(img);
+		return 0;
+	}
+	if ((drw->shm.shmaddr = img->data = shmat(drw->shm.shmid, NULL, 0)) == (void *)-1) {
+		shmctl(drw->shm.shmid, IPC_RMID, NULL);
+		img->data = NULL;
+		XDestroyImage(img);
+		return 0;
+	}
+	drw->shm.readOnly = False;
+
+	/* attaching fails on remote servers, this is the only round trip */
+	shmerror = 0;
+	xerror = XSetErrorHandler(shm_xerror);
+	XShmAttach(drw->dpy, &drw->shm);
+	XSync(drw->dpy, False);
+	XSetErrorHandler(xerror);
+	drw->syncs++;
+	/* the segment is destroyed once both sides detached */
+	shmctl(drw->shm.shmid, IPC_RMID, NULL);
+	if (shmerror) {
+		shmdt(drw->shm.shmaddr);
+		img->data = NULL;
+		XDestroyImage(img);
+		return 0;
+	}
+	drw->img = img;
+	drw->fb = img->data;
+	drw->stride = img->bytes_per_line;
+	return 1;
+}
+
+static Bool
+shm_iscompletion(Display *dpy, XEvent *ev, XPointer arg)
+{
+	Drw *drw = (Drw *)arg;
+
+	return ev->type == drw->shmevent &&
+	       ((XShmCompletionEvent *)ev)->shmseg == drw->shm.shmseg;
+}
+
+/* Wait until the server is done reading the image before touching it. The
+ * event loop hands completions to drw_handleevent, those still queued are
+ * taken here. After a sync every completion is queued, so this never waits
+ * for one the loop already took. */
+static void
+shm_wait(Drw *drw)
+{
+	XEvent ev;
+
+	while (drw->shmpending && XCheckIfEvent(drw->dpy, &ev, shm_iscompletion, (XPointer)drw))
+		drw->shmpending--;
+	if (!drw->shmpending)
+		return;
+	XSync(drw->dpy, False);
+	drw->syncs++;
+	while (drw->shmpending && XCheckIfEvent(drw->dpy, &ev, shm_iscompletion, (XPointer)drw))
+		drw->shmpending--;
+	drw->shmpending = 0;
+}
+
+static void
+shm_free(Drw *drw)
+{
+	if (!drw->img)
+		return;
+	shm_wait(drw);
+	XShmDetach(drw->dpy, &drw->shm);
+	shmdt(drw->shm.shmaddr);
+	drw->img->data = NULL;
+	XDestroyImage(drw->img);
+	drw->img = NULL;
+	drw->fb = NULL;
+}
+
+static int
+shm_resize(Drw *drw)
+{
+	shm_free(drw);
+	return shm_create(drw);
+}
+
+static size_t
+shm_size(Drw *drw)
+{
+	return (size_t)drw->stride * drw->ph;
+}
+
+static void
+shm_fill(Drw *drw, int x, int y, unsigned int w, unsigned int h, Clr *col)
+{
+	shm_wait(drw);
+	sw_fill(drw, x, y, w, h, col);
+}
+
+static void
+shm_text(Drw *drw, Fnt *font, Clr *col, int x, int y, const char *text, unsigned int len)
+{
+	shm_wait(drw);
+	sw_text(drw, font, col, x, y, text, len);
+}
+
+static void
+shm_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h, int dx, int dy)
+{
+	XShmPutImage(drw->dpy, win, drw->gc, drw->img, x, y, dx, dy, w, h, True);
+	drw->shmpending++;
+}
+
+/* The memory backend renders in software into an ARGB framebuffer and needs
+ * no X server at all. */
+static int
+mem_resize(Drw *drw)
+{
+	drw->stride = drw->pw * 4;
+	drw->fb = erealloc(drw->fb, (size_t)drw->stride * drw->ph);
+	return 1;
+}
+
+static void
+mem_free(Drw *drw)
+{
+	free(drw->fb);
+	drw->fb = NULL;
+}
+
+static size_t
+mem_size(Drw *drw)
+{
+	return (size_t)drw->stride * drw->ph;
+}
+
+static void
+mem_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h, int dx, int dy)
+{
+}
+
+static const Backend xbackend = {
+	"x", x_resize, x_free, x_size, x_fill, x_text, x_map, x_flush
+};
+static const Backend shmbackend = {
+	"shm", shm_resize, shm_free, shm_size, shm_fill, shm_text, shm_map, NULL
+};
+static const Backend membackend = {
+	"mem", mem_resize, mem_free, mem_size, sw_fill, sw_text, mem_map, NULL
+};
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h)
 {
@@ -70,13 +807,67 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->root = root;
 	drw->w = w;
 	drw->h = h;
-	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+	drw->pw = MAX(w, 1);
+	drw->ph = MAX(h, 1);
+	drw->backend = &xbackend;
+	drw->backend->resize(drw);
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
+	drw->maxfallback = 8;
+	drw->maxfallbackmem = 32 * 1024 * 1024;
 
 	return drw;
 }
 
+/* Create a drawing context rendering into memory, without an X server. Fonts
+ * are loaded with fontconfig and FreeType, colors are parsed or looked up in
+ * rgb.txt like for the other backends. */
+Drw *
+drw_create_mem(unsigned int w, unsigned int h)
+{
+	Drw *drw = ecalloc(1, sizeof(Drw));
+
+	if (FT_Init_FreeType(&drw->ft))
+		die("cannot initialize FreeType");
+	drw->w = w;
+	drw->h = h;
+	drw->pw = MAX(w, 1);
+	drw->ph = MAX(h, 1);
+	drw->backend = &membackend;
+	drw->backend->resize(drw);
+	drw->maxfallback = 8;
+	drw->maxfallbackmem = 32 * 1024 * 1024;
+
+	return drw;
+}
+
+/* Switch to client side rendering into a shared memory image. Returns 0 and
+ * keeps using the pixmap if MIT-SHM is not available. */
+int
+drw_useshm(Drw *drw)
+{
+	if (!drw || drw->backend != &xbackend)
+		return drw && drw->backend == &shmbackend;
+	if (!XShmQueryExtension(drw->dpy) || !shm_create(drw))
+		return 0;
+	x_free(drw);
+	drw->backend = &shmbackend;
+	drw->shmevent = XShmGetEventBase(drw->dpy) + ShmCompletion;
+	return 1;
+}
+
+/* Take an event the event loop has no handler for. Returns 1 if it belonged
+ * to drw. */
+int
+drw_handleevent(Drw *drw, XEvent *ev)
+{
+	if (!drw || drw->backend != &shmbackend || !shm_iscompletion(drw->dpy, ev, (XPointer)drw))
+		return 0;
+	if (drw->shmpending)
+		drw->shmpending--;
+	return 1;
+}
+
 void
 drw_resize(Drw *drw, unsigned int w, unsigned int h)
 {
@@ -85,20 +876,143 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 
 	drw->w = w;
 	drw->h = h;
-	if (drw->drawable)
-		XFreePixmap(drw->dpy, drw->drawable);
-	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	if (w <= drw->pw && h <= drw->ph)
+		return;
+
+	/* grow geometrically so resize storms reallocate only a few times */
+	if (w > drw->pw)
+		drw->pw = MAX(w, drw->pw + drw->pw / 2);
+	if (h > drw->ph)
+		drw->ph = MAX(h, drw->ph + drw->ph / 2);
+	if (!drw->backend->resize(drw))
+		die("cannot resize the %s backing store", drw->backend->name);
 }
 
 void
 drw_free(Drw *drw)
 {
-	XFreePixmap(drw->dpy, drw->drawable);
-	XFreeGC(drw->dpy, drw->gc);
+	size_t i;
+
+	drw->backend->free(drw);
+	if (drw->gc)
+		XFreeGC(drw->dpy, drw->gc);
 	drw_fontset_free(drw->fonts);
+	fallback_flush(drw);
+	if (drw->ft)
+		FT_Done_FreeType(drw->ft);
+	free(drw->fallback);
+	free(drw->fcache.tab);
+	free(drw->runs);
+	free(drw->rects);
+	free(drw->glyphs);
+	free(drw->scratch);
+	for (i = 0; i < LENGTH(drw->wcache.ent); i++)
+		free(drw->wcache.ent[i].text);
 	free(drw);
 }
 
+/* Write the drawing area as binary PPM, only software backends keep the
+ * pixels on the client side. */
+int
+drw_dump(Drw *drw, FILE *fp)
+{
+	uint32_t *row;
+	unsigned int x, y;
+
+	if (!drw || !fp || !drw->fb)
+		return -1;
+
+	fprintf(fp, "P6\n%u %u\n255\n", drw->w, drw->h);
+	for (y = 0; y < drw->h; y++) {
+		row = (uint32_t *)(drw->fb + y * drw->stride);
+		for (x = 0; x < drw->w; x++) {
+			fputc(row[x] >> 16 & 0xff, fp);
+			fputc(row[x] >> 8 & 0xff, fp);
+			fputc(row[x] & 0xff, fp);
+		}
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
+void
+drw_stats(Drw *drw, FILE *fp)
+{
+	if (!drw || !fp)
+		return;
+
+	fprintf(fp, "syncs: %lu\n", drw->syncs);
+	fprintf(fp, "backend: %s, %ux%u, %zu bytes\n", drw->backend->name,
+	        drw->pw, drw->ph, drw->backend->size(drw));
+	fprintf(fp, "fontcache: %lu hits (%lu without font), %lu misses, %zu entries\n",
+	        drw->fcache.hits, drw->fcache.nofont, drw->fcache.misses, drw->fcache.len);
+	fprintf(fp, "widthcache: %lu hits, %lu misses\n",
+	        drw->wcache.hits, drw->wcache.misses);
+	fprintf(fp, "runcache: %lu hits, %lu misses, %lu flushes\n",
+	        drw->rcache.hits, drw->rcache.misses, drw->rcache.flushes);
+	if (drw->backend->flush)
+		fprintf(fp, "batch: %lu frames, %lu commands in %lu requests\n",
+		        drw->batchframes, drw->batchcmds, drw->batchreqs);
+	fprintf(fp, "fallback: %u/%u fonts, %zu/%zu bytes\n",
+	        drw->nfallback, drw->maxfallback, drw->fallbackmem, drw->maxfallbackmem);
+}
+
+/* Open a font with fontconfig and FreeType for the memory backend. Color
+ * fonts are rejected, the software rasterizer only does coverage. */
+static Fnt *
+ftfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
+{
+	Fnt *font;
+	FT_Face face;
+	FcPattern *pattern = NULL, *match = fontpattern;
+	FcResult result;
+	FcChar8 *file;
+	FcBool iscol;
+	double px;
+	int index;
+
+	if (fontname) {
+		if (!(pattern = FcNameParse((FcChar8 *)fontname))) {
+			fprintf(stderr, "error, cannot parse font name to pattern: '%s'\n", fontname);
+			return NULL;
+		}
+		match = FcPatternDuplicate(pattern);
+		FcConfigSubstitute(NULL, match, FcMatchPattern);
+		FcDefaultSubstitute(match);
+		fontpattern = match;
+		match = FcFontMatch(NULL, fontpattern, &result);
+		FcPatternDestroy(fontpattern);
+	}
+	if (!match || FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch ||
+	    (FcPatternGetBool(match, FC_COLOR, 0, &iscol) == FcResultMatch && iscol)) {
+		fprintf(stderr, "error, cannot load font '%s'\n", fontname ? fontname : "(pattern)");
+		goto err;
+	}
+	if (FcPatternGetInteger(match, FC_INDEX, 0, &index) != FcResultMatch)
+		index = 0;
+	if (FcPatternGetDouble(match, FC_PIXEL_SIZE, 0, &px) != FcResultMatch)
+		px = 12;
+	if (FT_New_Face(drw->ft, (const char *)file, index, &face)) {
+		fprintf(stderr, "error, cannot open font file '%s'\n", file);
+		goto err;
+	}
+	FT_Set_Pixel_Sizes(face, 0, px + 0.5);
+
+	font = ecalloc(1, sizeof(Fnt));
+	font->face = face;
+	font->match = match;
+	font->pattern = pattern;
+	font->ascent = (face->size->metrics.ascender + 63) >> 6;
+	font->h = font->ascent + ((-face->size->metrics.descender + 63) >> 6);
+
+	return font;
+err:
+	if (match)
+		FcPatternDestroy(match);
+	if (pattern)
+		FcPatternDestroy(pattern);
+	return NULL;
+}
+
 /* This function is an implementation detail. Library users should use
  * drw_fontset_create instead.
  */
@@ -109,6 +1023,9 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 	XftFont *xfont = NULL;
 	FcPattern *pattern = NULL;
 
+	if (!drw->dpy)
+		return ftfont_create(drw, fontname, fontpattern);
+
 	if (fontname) {
 		/* Using the pattern found at font->xfont->pattern does not yield the
 		 * same substitution results as using the pattern returned by
@@ -149,6 +1066,7 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 	font = ecalloc(1, sizeof(Fnt));
 	font->xfont = xfont;
 	font->pattern = pattern;
+	font->ascent = xfont->ascent;
 	font->h = xfont->ascent + xfont->descent;
 	font->dpy = drw->dpy;
 
@@ -158,29 +1076,112 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 static void
 xfont_free(Fnt *font)
 {
+	unsigned int i;
+
 	if (!font)
 		return;
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
-	XftFontClose(font->dpy, font->xfont);
+	if (font->glyphs)
+		for (i = 0; i < GLYPHCACHE; i++)
+			free(font->glyphs[i].alpha);
+	free(font->glyphs);
+	if (font->xfont) {
+		XftFontClose(font->dpy, font->xfont);
+	} else {
+		FT_Done_Face(font->face);
+		FcPatternDestroy(font->match);
+	}
 	free(font);
 }
 
+/* The memory use of a font is dominated by the font file FreeType loads. */
+static size_t
+xfont_size(Fnt *font)
+{
+	FcChar8 *file;
+	struct stat st;
+
+	if (FcPatternGetString(font->xfont ? font->xfont->pattern : font->match,
+	                       FC_FILE, 0, &file) == FcResultMatch &&
+	    !stat((const char *)file, &st))
+		return st.st_size;
+	return 0;
+}
+
+static void
+fallback_flush(Drw *drw)
+{
+	if (drw->batch)
+		drw->backend->flush(drw);
+	while (drw->nfallback)
+		xfont_free(drw->fallback[--drw->nfallback]);
+	drw->fallbackmem = 0;
+}
+
+/* Add a font to the fallback pool, evicting the least recently used fonts
+ * until it fits into the configured limits. Fonts used by the text being
+ * laid out are not evicted, the pool may exceed its limits until the next
+ * call instead. Returns 0 if the pool is disabled and the font not added. */
+static int
+fallback_add(Drw *drw, Fnt *font)
+{
+	unsigned int i;
+	int lru;
+
+	if (!drw->maxfallback)
+		return 0;
+	font->size = xfont_size(font);
+	font->lastused = ++drw->fontclock;
+	while (drw->nfallback >= drw->maxfallback ||
+	       drw->fallbackmem + font->size > drw->maxfallbackmem) {
+		for (lru = -1, i = 0; i < drw->nfallback; i++)
+			if (drw->fallback[i]->lastused < drw->layoutstart &&
+			    (lru < 0 || drw->fallback[i]->lastused < drw->fallback[lru]->lastused))
+				lru = i;
+		if (lru < 0)
+			break;
+		/* queued glyphs may use the evicted font */
+		if (drw->batch)
+			drw->backend->flush(drw);
+		/* only the cache entries pointing to the evicted font go,
+		 * widths do not depend on which font object drew them */
+		fontcache_drop(&drw->fcache, drw->fallback[lru]);
+		runcache_drop(&drw->rcache, drw->fallback[lru]);
+		drw->fallbackmem -= drw->fallback[lru]->size;
+		xfont_free(drw->fallback[lru]);
+		drw->fallback[lru] = drw->fallback[--drw->nfallback];
+	}
+	if (drw->nfallback == drw->fallbacksize) {
+		drw->fallbacksize = MAX(drw->maxfallback, drw->fallbacksize * 2);
+		drw->fallbacksize = MAX(drw->fallbacksize, 1);
+		drw->fallback = erealloc(drw->fallback, drw->fallbacksize * sizeof(Fnt *));
+	}
+	drw->fallback[drw->nfallback++] = font;
+	drw->fallbackmem += font->size;
+	return 1;
+}
+
 Fnt*
 drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 {
-	Fnt *cur, *ret = NULL;
+	Fnt *ret = NULL;
 	size_t i;
 
 	if (!drw || !fonts)
 		return NULL;
 
-	for (i = 1; i <= fontcount; i++) {
-		if ((cur = xfont_create(drw, fonts[fontcount - i], NULL))) {
-			cur->next = ret;
-			ret = cur;
-		}
+	/* only the first font is opened now, the others when a codepoint
+	 * needs them */
+	for (i = 0; i < fontcount && !ret; i++)
+		ret = xfont_create(drw, fonts[i], NULL);
+	if (ret) {
+		ret->pending = fonts + i;
+		ret->npending = fontcount - i;
 	}
+	fallback_flush(drw);
+	fontcache_clear(&drw->fcache);
+	runcache_flush(&drw->rcache);
 	return (drw->fonts = ret);
 }
 
@@ -193,16 +1194,144 @@ drw_fontset_free(Fnt *font)
 	}
 }
 
+/* Parse #rgb and #rrggbb colors without asking the X server. */
+static int
+clr_parse(const char *clrname, XRenderColor *c)
+{
+	unsigned int i, n, v[6];
+
+	n = strlen(clrname) - 1;
+	if (clrname[0] != '#' || (n != 3 && n != 6))
+		return 0;
+	for (i = 0; i < n; i++) {
+		if (!BETWEEN(clrname[i + 1] | 0x20, 'a', 'f') && !BETWEEN(clrname[i + 1], '0', '9'))
+			return 0;
+		v[i] = BETWEEN(clrname[i + 1], '0', '9') ? clrname[i + 1] - '0' : (clrname[i + 1] | 0x20) - 'a' + 10;
+	}
+	if (n == 3) {
+		c->red = v[0] * 0x1111;
+		c->green = v[1] * 0x1111;
+		c->blue = v[2] * 0x1111;
+	} else {
+		c->red = (v[0] << 4 | v[1]) * 0x101;
+		c->green = (v[2] << 4 | v[3]) * 0x101;
+		c->blue = (v[4] << 4 | v[5]) * 0x101;
+	}
+	c->alpha = 0xffff;
+	return 1;
+}
+
+/* Compare X color names, which ignore case and spaces. */
+static int
+clr_namecmp(const char *a, const char *b)
+{
+	for (;; a++, b++) {
+		while (*a == ' ')
+			a++;
+		while (*b == ' ')
+			b++;
+		if ((*a | 0x20) != (*b | 0x20) || !*a || !*b)
+			return *a || *b;
+	}
+}
+
+/* Resolve the color names not found yet with one pass over the local color
+ * database instead of one X server round trip per name. */
+static void
+clr_lookup(const char *clrnames[], Clr *dest, int *found, size_t n)
+{
+	static const char *rgbfiles[] = { "/usr/share/X11/rgb.txt", "/etc/X11/rgb.txt" };
+	FILE *fp = NULL;
+	char line[128], *name;
+	unsigned int r, g, b;
+	size_t i, left = 0;
+	int off;
+
+	for (i = 0; i < n; i++)
+		left += !found[i];
+	for (i = 0; left && !fp && i < LENGTH(rgbfiles); i++)
+		fp = fopen(rgbfiles[i], "r");
+	if (!fp)
+		return;
+
+	while (left && fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%u %u %u %n", &r, &g, &b, &off) != 3)
+			continue;
+		name = line + off;
+		name[strcspn(name, "\n")] = '\0';
+		for (i = 0; i < n; i++) {
+			if (found[i] || clr_namecmp(name, clrnames[i]))
+				continue;
+			dest[i].color.red = (r & 0xff) * 0x101;
+			dest[i].color.green = (g & 0xff) * 0x101;
+			dest[i].color.blue = (b & 0xff) * 0x101;
+			dest[i].color.alpha = 0xffff;
+			found[i] = 1;
+			left--;
+		}
+	}
+	fclose(fp);
+}
+
+static unsigned long
+clr_channel(unsigned short v, unsigned long mask)
+{
+	int shift = 0, bits = 0;
+
+	if (!mask)
+		return 0;
+	while (!(mask >> shift & 1))
+		shift++;
+	while (bits < 16 && mask >> (shift + bits) & 1)
+		bits++;
+	return ((unsigned long)v >> (16 - bits)) << shift;
+}
+
+/* Allocate a color, dest->color holds its value if known is set. TrueColor
+ * pixels are computed from the visual masks without asking the server. */
+static void
+clr_alloc(Drw *drw, Clr *dest, const char *clrname, int known)
+{
+	Visual *visual;
+
+	if (!drw->dpy) {
+		if (!known)
+			die("error, cannot parse color '%s'", clrname);
+		dest->pixel = 0xff000000 | clr_channel(dest->color.red, 0xff0000) |
+		              clr_channel(dest->color.green, 0xff00) | clr_channel(dest->color.blue, 0xff);
+		return;
+	}
+
+	visual = DefaultVisual(drw->dpy, drw->screen);
+	if (known && visual->class == TrueColor) {
+		dest->pixel = clr_channel(dest->color.red, visual->red_mask) |
+		              clr_channel(dest->color.green, visual->green_mask) |
+		              clr_channel(dest->color.blue, visual->blue_mask);
+		return;
+	}
+
+	drw->syncs++;
+	if (known) {
+		if (!XftColorAllocValue(drw->dpy, visual, DefaultColormap(drw->dpy, drw->screen),
+		                        &dest->color, dest))
+			die("error, cannot allocate color '%s'", clrname);
+	} else if (!XftColorAllocName(drw->dpy, visual, DefaultColormap(drw->dpy, drw->screen),
+	                              clrname, dest)) {
+		die("error, cannot allocate color '%s'", clrname);
+	}
+}
+
 void
 drw_clr_create(Drw *drw, Clr *dest, const char *clrname)
 {
+	int found;
+
 	if (!drw || !dest || !clrname)
 		return;
 
-	if (!XftColorAllocName(drw->dpy, DefaultVisual(drw->dpy, drw->screen),
-	                       DefaultColormap(drw->dpy, drw->screen),
-	                       clrname, dest))
-		die("error, cannot allocate color '%s'", clrname);
+	if (!(found = clr_parse(clrname, &dest->color)))
+		clr_lookup(&clrname, dest, &found, 1);
+	clr_alloc(drw, dest, clrname, found);
 }
 
 /* Wrapper to create color schemes. The caller has to call free(3) on the
@@ -212,21 +1341,46 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 {
 	size_t i;
 	Clr *ret;
+	int *found;
 
 	/* need at least two colors for a scheme */
 	if (!drw || !clrnames || clrcount < 2 || !(ret = ecalloc(clrcount, sizeof(XftColor))))
 		return NULL;
 
+	found = ecalloc(clrcount, sizeof(int));
 	for (i = 0; i < clrcount; i++)
-		drw_clr_create(drw, &ret[i], clrnames[i]);
+		found[i] = clr_parse(clrnames[i], &ret[i].color);
+	clr_lookup(clrnames, ret, found, clrcount);
+	for (i = 0; i < clrcount; i++)
+		clr_alloc(drw, &ret[i], clrnames[i], found[i]);
+	free(found);
 	return ret;
 }
 
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
-		drw->fonts = set;
+	if (!drw)
+		return;
+	drw->fonts = set;
+	/* fallback fonts are matched against the primary font */
+	fallback_flush(drw);
+	fontcache_clear(&drw->fcache);
+	runcache_flush(&drw->rcache);
+}
+
+void
+drw_setfallbacklimit(Drw *drw, unsigned int count, size_t bytes)
+{
+	if (!drw)
+		return;
+	fallback_flush(drw);
+	fontcache_clear(&drw->fcache);
+	free(drw->fallback);
+	drw->fallback = NULL;
+	drw->fallbacksize = 0;
+	drw->maxfallback = count;
+	drw->maxfallbackmem = bytes;
 }
 
 void
@@ -239,65 +1393,96 @@ drw_setscheme(Drw *drw, Clr *scm)
 void
 drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert)
 {
+	Clr *col;
+
 	if (!drw || !drw->scheme)
 		return;
-	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
-	if (filled)
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-	else
-		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
+	col = &drw->scheme[invert ? ColBg : ColFg];
+	if (filled) {
+		drw->backend->fill(drw, x, y, w, h, col);
+	} else {
+		drw->backend->fill(drw, x, y, w, 1, col);
+		drw->backend->fill(drw, x, y + h - 1, w, 1, col);
+		drw->backend->fill(drw, x, y, 1, h, col);
+		drw->backend->fill(drw, x + w - 1, y, 1, h, col);
+	}
 }
 
-int
-drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
+/* Return the length of the longest prefix of text, cut on a UTF-8 boundary,
+ * that fits into w. Glyph advances are summed up until the first glyph that
+ * does not fit, the width of the prefix is stored in tw. */
+static size_t
+xfont_fit(Fnt *font, const char *text, size_t len, unsigned int w, unsigned int *tw)
 {
-	char buf[1024];
-	int ty;
-	unsigned int ew;
-	XftDraw *d = NULL;
+	size_t i, n;
+	long cp;
+	int adv;
+
+	*tw = 0;
+	for (i = 0; i < len; i += n) {
+		n = utf8decode(text + i, &cp, UTF_SIZ);
+		adv = font_advance(font, font_index(font, cp));
+		if (*tw + adv > w)
+			break;
+		*tw += adv;
+	}
+	return i;
+}
+
+static TextRun *
+textrun_add(Drw *drw, unsigned int n)
+{
+	if (n == drw->runsize) {
+		drw->runsize = MAX(16, drw->runsize * 2);
+		drw->runs = erealloc(drw->runs, drw->runsize * sizeof(TextRun));
+	}
+	return &drw->runs[n];
+}
+
+/* Split text into runs of the same font and place them, shortening the text
+ * with an ellipsis if it does not fit into w. The runs are stored in
+ * drw->runs, the total width is returned. */
+static unsigned int
+text_layout(Drw *drw, const char *text, unsigned int w, unsigned int *nruns)
+{
+	unsigned int ew, ellipsisw, n = 0, x = 0;
 	Fnt *usedfont, *curfont, *nextfont;
-	size_t i, len;
-	int utf8strlen, utf8charlen, render = x || y || w || h;
+	TextRun *run;
+	size_t len;
+	int utf8strlen, utf8charlen, overflow = 0;
 	long utf8codepoint = 0;
-	const char *utf8str;
+	const char *utf8str, *start = text, *end = text + strlen(text);
 	FcCharSet *fccharset;
 	FcPattern *fcpattern;
 	FcPattern *match;
 	XftResult result;
 	int charexists = 0;
 
-	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
-		return 0;
-
-	if (!render) {
-		w = ~w;
-	} else {
-		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
-		x += lpad;
-		w -= lpad;
-	}
-
+	/* fonts used from here on are pinned in the fallback pool */
+	drw->layoutstart = drw->fontclock + 1;
 	usedfont = drw->fonts;
 	while (1) {
 		utf8strlen = 0;
 		utf8str = text;
 		nextfont = NULL;
 		while (*text) {
+			/* take printable ASCII runs at once if a single font has them */
+			if (!charexists && usedfont == fontcache_asciifont(drw) &&
+			    (utf8charlen = utf8printlen(text, end - text))) {
+				utf8strlen += utf8charlen;
+				text += utf8charlen;
+				continue;
+			}
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
+			/* a character no font has is drawn with the primary font */
+			curfont = charexists ? drw->fonts : fontcache_lookup(drw, utf8codepoint);
+			if (curfont) {
+				charexists = 1;
+				if (curfont == usedfont) {
+					utf8strlen += utf8charlen;
+					text += utf8charlen;
+				} else {
+					nextfont = curfont;
 				}
 			}
 
@@ -309,28 +1494,30 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 
 		if (utf8strlen) {
 			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
-
-			if (len) {
-				memcpy(buf, utf8str, len);
-				buf[len] = '\0';
-				if (len < utf8strlen)
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
-
-				if (render) {
-					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
-				}
-				x += ew;
-				w -= ew;
+			len = utf8strlen;
+			ellipsisw = 0;
+			/* shorten text if necessary, leaving room for the ellipsis */
+			if (ew > w) {
+				overflow = 1;
+				drw_font_getexts(usedfont, "...", 3, &ellipsisw, NULL);
+				if (ellipsisw > w)
+					ellipsisw = 0;
+				len = xfont_fit(usedfont, utf8str, len, w - ellipsisw, &ew);
 			}
+
+			run = textrun_add(drw, n++);
+			run->font = usedfont;
+			run->off = utf8str - start;
+			run->len = len;
+			run->x = x;
+			run->w = ew;
+			run->ellipsisw = ellipsisw;
+			usedfont->lastused = ++drw->fontclock;
+			x += ew + ellipsisw;
+			w -= ew + ellipsisw;
 		}
 
-		if (!*text) {
+		if (!*text || overflow) {
 			break;
 		} else if (nextfont) {
 			charexists = 0;
@@ -355,38 +1542,175 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 
 			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
 			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+			if (drw->dpy)
+				match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+			else
+				match = FcFontMatch(NULL, fcpattern, &result);
 
 			FcCharSetDestroy(fccharset);
 			FcPatternDestroy(fcpattern);
 
 			if (match) {
 				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					usedfont = drw->fonts;
+				if (usedfont && font_has(usedfont, utf8codepoint) &&
+				    fallback_add(drw, usedfont)) {
+					fontcache_insert(&drw->fcache, utf8codepoint, usedfont);
+					continue;
 				}
+				xfont_free(usedfont);
+				usedfont = drw->fonts;
 			}
+			/* do not ask fontconfig again for this codepoint */
+			fontcache_insert(&drw->fcache, utf8codepoint, &nofont);
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
+	*nruns = n;
+	return x;
+}
 
-	return x + (render ? w : 0);
+static void
+runcache_flush(RunCache *rc)
+{
+	memset(rc->ent, 0, sizeof(rc->ent));
+	rc->arenalen = 0;
+	rc->flushes++;
+}
+
+/* Forget the layouts using a font, their arena space is reused at the next
+ * flush. */
+static void
+runcache_drop(RunCache *rc, Fnt *font)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < LENGTH(rc->ent); i++)
+		for (j = 0; rc->ent[i].text && j < rc->ent[i].nruns; j++)
+			if (rc->ent[i].runs[j].font == font)
+				rc->ent[i].text = NULL;
+}
+
+/* Return the layout of text in w, from the cache if possible. */
+static TextRun *
+runcache_get(Drw *drw, const char *text, unsigned int w, unsigned int *nruns, unsigned int *tw)
+{
+	RunCache *rc = &drw->rcache;
+	unsigned long h;
+	size_t i, len, runbytes, size;
+	unsigned int j;
+
+	h = strhash(text);
+	i = (h ^ w * 2654435761UL) % LENGTH(rc->ent);
+	if (rc->ent[i].text && rc->ent[i].hash == h && rc->ent[i].w == w &&
+	    rc->ent[i].gen == drw->fcache.gen && !strcmp(rc->ent[i].text, text)) {
+		rc->hits++;
+		for (j = 0; j < rc->ent[i].nruns; j++)
+			rc->ent[i].runs[j].font->lastused = ++drw->fontclock;
+		*nruns = rc->ent[i].nruns;
+		*tw = rc->ent[i].width;
+		return rc->ent[i].runs;
+	}
+	rc->misses++;
+	*tw = text_layout(drw, text, w, nruns);
+
+	/* runs go first in the arena, the text is padded so the runs of the
+	 * next entry are aligned too */
+	len = strlen(text) + 1;
+	runbytes = *nruns * sizeof(TextRun);
+	size = runbytes + len;
+	size += (ARENAALIGN - size % ARENAALIGN) % ARENAALIGN;
+	if (size > sizeof(rc->arena))
+		return drw->runs;
+	if (rc->arenalen + size > sizeof(rc->arena))
+		runcache_flush(rc);
+	rc->ent[i].runs = (TextRun *)(rc->arena.c + rc->arenalen);
+	rc->ent[i].text = rc->arena.c + rc->arenalen + runbytes;
+	rc->arenalen += size;
+	memcpy(rc->ent[i].runs, drw->runs, *nruns * sizeof(TextRun));
+	memcpy(rc->ent[i].text, text, len);
+	rc->ent[i].hash = h;
+	rc->ent[i].w = w;
+	/* laying out may load fallback fonts and start a new generation */
+	rc->ent[i].gen = drw->fcache.gen;
+	rc->ent[i].nruns = *nruns;
+	rc->ent[i].width = *tw;
+	return rc->ent[i].runs;
+}
+
+int
+drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
+{
+	TextRun *runs;
+	unsigned int i, nruns, tw;
+	int ty, render = x || y || w || h;
+	XftColor *fg;
+
+	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
+		return 0;
+
+	if (!render) {
+		w = ~w;
+	} else {
+		drw->backend->fill(drw, x, y, w, h, &drw->scheme[invert ? ColFg : ColBg]);
+		x += lpad;
+		w -= lpad;
+	}
+
+	runs = runcache_get(drw, text, w, &nruns, &tw);
+	if (!render)
+		return x + tw;
+
+	fg = &drw->scheme[invert ? ColBg : ColFg];
+	for (i = 0; i < nruns; i++) {
+		ty = y + (h - runs[i].font->h) / 2 + runs[i].font->ascent;
+		if (runs[i].len)
+			drw->backend->text(drw, runs[i].font, fg, x + runs[i].x, ty,
+			                   text + runs[i].off, runs[i].len);
+		if (runs[i].ellipsisw)
+			drw->backend->text(drw, runs[i].font, fg, x + runs[i].x + runs[i].w, ty, "...", 3);
+	}
+	return x + w;
+}
+
+/* Queue drawing until drw_frame_end, backends which cannot batch draw
+ * immediately. */
+void
+drw_frame_begin(Drw *drw)
+{
+	if (!drw || !drw->backend->flush)
+		return;
+
+	drw->batch = 1;
+	drw->batchframes++;
 }
 
 void
-drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
+drw_frame_end(Drw *drw)
+{
+	if (!drw || !drw->batch)
+		return;
+
+	drw->backend->flush(drw);
+	drw->batch = 0;
+}
+
+void
+drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h, int dx, int dy)
 {
 	if (!drw)
 		return;
 
-	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
+	drw->backend->map(drw, win, x, y, w, h, dx, dy);
+}
+
+/* Wait for the X server to process all requests, only for debugging. */
+void
+drw_sync(Drw *drw)
+{
+	if (!drw || !drw->dpy)
+		return;
+
 	XSync(drw->dpy, False);
+	drw->syncs++;
 }
 
 unsigned int
@@ -397,17 +1721,60 @@ drw_fontset_getwidth(Drw *drw, const char *text)
 	return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
 }
 
+unsigned int
+drw_fontset_getwidth_cached(Drw *drw, const char *text)
+{
+	unsigned long h;
+	size_t i, len;
+	unsigned int w;
+	WidthCache *wc;
+
+	if (!drw || !drw->fonts || !text)
+		return 0;
+
+	wc = &drw->wcache;
+	h = strhash(text);
+	i = h % LENGTH(wc->ent);
+	if (wc->ent[i].text && wc->ent[i].hash == h &&
+	    wc->ent[i].gen == drw->fcache.gen && !strcmp(wc->ent[i].text, text)) {
+		wc->hits++;
+		return wc->ent[i].w;
+	}
+	wc->misses++;
+	w = drw_fontset_getwidth(drw, text);
+
+	len = strlen(text);
+	free(wc->ent[i].text);
+	wc->ent[i].text = ecalloc(len + 1, 1);
+	memcpy(wc->ent[i].text, text, len);
+	wc->ent[i].hash = h;
+	/* measuring may load fallback fonts and start a new generation */
+	wc->ent[i].gen = drw->fcache.gen;
+	wc->ent[i].w = w;
+	return w;
+}
+
 void
 drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h)
 {
 	XGlyphInfo ext;
+	unsigned int i, n, tw = 0;
+	long cp;
 
 	if (!font || !text)
 		return;
 
-	XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+	if (font->xfont) {
+		XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+		tw = ext.xOff;
+	} else {
+		for (i = 0; i < len; i += n) {
+			n = utf8decode(text + i, &cp, UTF_SIZ);
+			tw += font_advance(font, font_index(font, cp));
+		}
+	}
 	if (w)
-		*w = ext.xOff;
+		*w = tw;
 	if (h)
 		*h = font->h;
 }
@@ -417,7 +1784,7 @@ drw_cur_create(Drw *drw, int shape)
 {
 	Cur *cur;
 
-	if (!drw || !(cur = ecalloc(1, sizeof(Cur))))
+	if (!drw || !drw->dpy || !(cur = ecalloc(1, sizeof(Cur))))
 		return NULL;
 
 	cur->cursor = XCreateFontCursor(drw->dpy, shape);
@@ -428,7 +1795,7 @@ drw_cur_create(Drw *drw, int shape)
 void
 drw_cur_free(Drw *drw, Cur *cursor)
 {
-	if (!cursor)
+	if (!drw || !cursor)
 		return;
 
 	XFreeCursor(drw->dpy, cursor->cursor);
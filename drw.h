@@ -4,37 +4,165 @@ typedef struct {
 	Cursor cursor;
 } Cur;
 
+/* rasterized glyph for software rendering */
+typedef struct {
+	unsigned int index;     /* glyph index + 1, 0 for an empty slot */
+	int left, top, adv;
+	unsigned int w, h;
+	unsigned char *alpha;
+} GlyphImg;
+
 typedef struct Fnt {
 	Display *dpy;
 	unsigned int h;
+	int ascent;
 	XftFont *xfont;
+	FT_Face face;           /* headless fonts have no xfont */
+	FcPattern *match;
 	FcPattern *pattern;
 	struct Fnt *next;
+	GlyphImg *glyphs;       /* direct-mapped by glyph index */
+	unsigned long lastused; /* fallback pool LRU clock */
+	size_t size;            /* approximate memory use */
+	const char **pending;   /* on the set head, names not opened yet */
+	size_t npending;
 } Fnt;
 
+typedef struct {
+	long cp;
+	Fnt *font;
+} FntCacheEnt;
+
+/* codepoint to font lookup cache, ASCII is direct-mapped */
+typedef struct {
+	Fnt *ascii[128];
+	Fnt *asciifont;    /* font of all printable ASCII, if there is one */
+	int asciichecked;
+	FntCacheEnt *tab;
+	size_t len, size;
+	unsigned long gen; /* bumped whenever font resolution may change */
+	unsigned long hits, misses, nofont;
+} FntCache;
+
+/* text width cache, direct-mapped by string hash */
+typedef struct {
+	struct {
+		unsigned long hash, gen;
+		char *text;
+		unsigned int w;
+	} ent[64];
+	unsigned long hits, misses;
+} WidthCache;
+
+/* a piece of text drawn with one font */
+typedef struct {
+	Fnt *font;
+	unsigned int off, len;  /* byte range in the text */
+	unsigned int x, w;      /* offset from the text start and width */
+	unsigned int ellipsisw; /* width of the trailing ellipsis, if any */
+} TextRun;
+
+/* text layout cache, entries live in the arena until it fills up */
+typedef struct {
+	struct {
+		unsigned long hash, gen;
+		unsigned int w;         /* available width */
+		char *text;
+		TextRun *runs;
+		unsigned int nruns, width;
+	} ent[64];
+	union {
+		char c[16384];
+		TextRun align;  /* entries start TextRun aligned */
+	} arena;
+	size_t arenalen;        /* always a multiple of the entry alignment */
+	unsigned long hits, misses, flushes;
+} RunCache;
+
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
+/* drawing commands queued between drw_frame_begin and drw_frame_end */
+typedef struct {
+	unsigned long pixel;
+	XRectangle r;
+} DrawRect;
+
 typedef struct {
+	Clr *col;
+	XftGlyphFontSpec spec;
+} DrawGlyph;
+
+typedef struct Drw Drw;
+
+/* rendering backend */
+typedef struct {
+	const char *name;
+	int (*resize)(Drw *drw);        /* (re)create the pw x ph backing store */
+	void (*free)(Drw *drw);
+	size_t (*size)(Drw *drw);       /* backing store bytes */
+	void (*fill)(Drw *drw, int x, int y, unsigned int w, unsigned int h, Clr *col);
+	void (*text)(Drw *drw, Fnt *font, Clr *col, int x, int y, const char *text, unsigned int len);
+	void (*map)(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h, int dx, int dy);
+	void (*flush)(Drw *drw);        /* emit queued commands, NULL if drawing is immediate */
+} Backend;
+
+struct Drw {
 	unsigned int w, h;
+	unsigned int pw, ph;    /* pixmap size, grows geometrically */
 	Display *dpy;
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;
+	XImage *img;            /* MIT-SHM image */
+	XShmSegmentInfo shm;
+	int shmevent;           /* ShmCompletion event type */
+	unsigned int shmpending; /* puts the server may still read the image for */
+	char *fb;               /* framebuffer of the software backends */
+	unsigned int stride;
+	const Backend *backend;
+	FT_Library ft;          /* headless font loading */
+	int batch;              /* queue drawing until drw_frame_end */
+	DrawRect *rects;
+	unsigned int nrects, rectsize;
+	DrawGlyph *glyphs;
+	unsigned int nglyphs, glyphsize;
+	XRectangle textbox;     /* bounds of the queued text */
+	void *scratch;
+	size_t scratchsize;
+	unsigned long batchframes, batchcmds, batchreqs;
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
-} Drw;
+	FntCache fcache;
+	WidthCache wcache;
+	RunCache rcache;
+	TextRun *runs;          /* layout scratch space */
+	unsigned int runsize;
+	Fnt **fallback;         /* fallback font pool, the fontset is pinned */
+	unsigned int nfallback, fallbacksize, maxfallback;
+	size_t fallbackmem, maxfallbackmem;
+	unsigned long fontclock, layoutstart;
+	unsigned long syncs;    /* requests through drw that wait for a reply */
+};
 
 /* Drawable abstraction */
 Drw *drw_create(Display *dpy, int screen, Window win, unsigned int w, unsigned int h);
+Drw *drw_create_mem(unsigned int w, unsigned int h);
 void drw_resize(Drw *drw, unsigned int w, unsigned int h);
 void drw_free(Drw *drw);
+int drw_useshm(Drw *drw);
+int drw_handleevent(Drw *drw, XEvent *ev);
+void drw_stats(Drw *drw, FILE *fp);
+int drw_dump(Drw *drw, FILE *fp);
 
-/* Fnt abstraction */
+/* Fnt abstraction, fonts after the first are opened on first use and the
+ * names must stay valid until then */
 Fnt *drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount);
 void drw_fontset_free(Fnt* set);
 unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
+unsigned int drw_fontset_getwidth_cached(Drw *drw, const char *text);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
 
 /* Colorscheme abstraction */
@@ -47,11 +175,17 @@ void drw_cur_free(Drw *drw, Cur *cursor);
 
 /* Drawing context manipulation */
 void drw_setfontset(Drw *drw, Fnt *set);
+void drw_setfallbacklimit(Drw *drw, unsigned int count, size_t bytes);
 void drw_setscheme(Drw *drw, Clr *scm);
 
 /* Drawing functions */
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
 
+/* Frame batching */
+void drw_frame_begin(Drw *drw);
+void drw_frame_end(Drw *drw);
+
 /* Map functions */
-void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
+void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h, int dx, int dy);
+void drw_sync(Drw *drw);
@@ -0,0 +1,73 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+/* Values below 2 * HIST_SUB get a bucket each, above that every power of two
+ * is split into HIST_SUB buckets. */
+static unsigned int
+hist_bucket(uint64_t v)
+{
+	unsigned int e = 0;
+
+	if (v < 2 * HIST_SUB)
+		return v;
+	while (v >> e >= 2 * HIST_SUB)
+		e += 1;
+	return (e + 1) * HIST_SUB + (v >> e) - HIST_SUB;
+}
+
+/* Return the largest value that falls into bucket i. */
+static uint64_t
+hist_value(unsigned int i)
+{
+	unsigned int e;
+
+	if (i < 2 * HIST_SUB)
+		return i;
+	e = i / HIST_SUB - 1;
+	return (((uint64_t)(i % HIST_SUB + HIST_SUB) + 1) << e) - 1;
+}
+
+void
+hist_add(Hist *h, uint64_t v)
+{
+	if (!h->count || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->bucket[hist_bucket(v)]++;
+}
+
+uint64_t
+hist_percentile(const Hist *h, double p)
+{
+	uint64_t n = 0, rank;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+	rank = p / 100 * h->count;
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if ((n += h->bucket[i]) >= rank)
+			break;
+	}
+	if (i == HIST_BUCKETS || hist_value(i) > h->max)
+		return h->max;
+	return hist_value(i) < h->min ? h->min : hist_value(i);
+}
+
+/* Print count, mean, percentiles and maximum, values are divided by scale. */
+void
+hist_print(const Hist *h, const char *name, double scale, FILE *fp)
+{
+	fprintf(fp, "%-16s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+	        (unsigned long)h->count, h->count ? h->sum / scale / h->count : 0,
+	        hist_percentile(h, 50) / scale, hist_percentile(h, 90) / scale,
+	        hist_percentile(h, 99) / scale, h->max / scale);
+}
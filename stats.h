@@ -0,0 +1,14 @@
+/* See LICENSE file for copyright and license details. */
+
+#define HIST_SUB      8         /* buckets per power of two, 12.5% precision */
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+/* log-linear histogram in the style of HdrHistogram */
+typedef struct {
+	uint64_t count, sum, min, max;
+	uint32_t bucket[HIST_BUCKETS];
+} Hist;
+
+void hist_add(Hist *h, uint64_t v);
+uint64_t hist_percentile(const Hist *h, double p);
+void hist_print(const Hist *h, const char *name, double scale, FILE *fp);
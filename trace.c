@@ -0,0 +1,94 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <X11/Xlib.h>
+
+#include "trace.h"
+
+#ifdef TRACE
+/* The ring is only written from the event loop, which also dumps it, so it
+ * needs no locking. Recording neither allocates nor enters the kernel,
+ * CLOCK_MONOTONIC is read through the vDSO. */
+static TraceRec ring[TRACE_SIZE];
+static uint64_t head;
+
+uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+record(unsigned int type, uint32_t arg, uint32_t pos, uint64_t start)
+{
+	TraceRec *r = &ring[head++ & (TRACE_SIZE - 1)];
+
+	r->ts = start;
+	r->dur = trace_now() - start;
+	r->arg = arg;
+	r->type = type;
+	r->pos = pos;
+}
+
+void
+trace_record(unsigned int type, uint32_t arg, uint64_t start)
+{
+	record(type, arg, 0, start);
+}
+
+void
+trace_event(XEvent *ev, uint64_t start)
+{
+	uint32_t arg, pos = 0;
+
+	switch (ev->type) {
+	case KeyPress:
+		arg = ev->xkey.keycode;
+		break;
+	case ButtonPress:
+		arg = ev->xbutton.button;
+		break;
+	case ConfigureNotify:
+		arg = (uint32_t)ev->xconfigure.width << 16 | (ev->xconfigure.height & 0xffff);
+		break;
+	case Expose:
+		arg = (uint32_t)ev->xexpose.width << 16 | (ev->xexpose.height & 0xffff);
+		pos = (uint32_t)ev->xexpose.x << 16 | (ev->xexpose.y & 0xffff);
+		break;
+	default:
+		arg = 0;
+		break;
+	}
+	record(ev->type, arg, pos, start);
+}
+
+/* Write the records in the ring, oldest first. */
+int
+trace_dump(const char *path)
+{
+	TraceHdr hdr = { TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRec), 0 };
+	FILE *fp;
+	uint64_t first;
+
+	hdr.count = head < TRACE_SIZE ? head : TRACE_SIZE;
+	first = head - hdr.count;
+	if (!(fp = fopen(path, "wb")))
+		return -1;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	if (first % TRACE_SIZE + hdr.count > TRACE_SIZE) {
+		fwrite(&ring[first % TRACE_SIZE], sizeof(TraceRec), TRACE_SIZE - first % TRACE_SIZE, fp);
+		fwrite(ring, sizeof(TraceRec), head % TRACE_SIZE, fp);
+	} else {
+		fwrite(&ring[first % TRACE_SIZE], sizeof(TraceRec), hdr.count, fp);
+	}
+	if (ferror(fp)) {
+		fclose(fp);
+		return -1;
+	}
+	return fclose(fp) == EOF ? -1 : 0;
+}
+#endif
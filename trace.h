@@ -0,0 +1,37 @@
+/* See LICENSE file for copyright and license details. */
+
+#define TRACE_MAGIC   0x52545758 /* "XWTR" */
+#define TRACE_VERSION 2
+#define TRACE_SIZE    4096       /* records kept, a power of two */
+
+enum { TraceDraw = 256 };        /* record types above the X event types */
+
+typedef struct {
+	uint32_t magic, version;
+	uint32_t recsize;            /* sizeof(TraceRec) of the writer */
+	uint32_t count;
+} TraceHdr;
+
+typedef struct {
+	uint64_t ts;                 /* CLOCK_MONOTONIC nanoseconds */
+	uint32_t dur;                /* nanoseconds spent handling */
+	uint32_t arg;                /* keycode, button, width << 16 | height */
+	uint16_t type;               /* X event type or TraceDraw */
+	uint16_t pad;
+	uint32_t pos;                /* x << 16 | y of an Expose */
+} TraceRec;
+
+#ifdef TRACE
+#define TRACE_START(t)           uint64_t t = trace_now()
+#define TRACE_EVENT(ev, t)       trace_event((ev), (t))
+#define TRACE_RECORD(ty, a, t)   trace_record((ty), (a), (t))
+
+uint64_t trace_now(void);
+void trace_event(XEvent *ev, uint64_t start);
+void trace_record(unsigned int type, uint32_t arg, uint64_t start);
+int trace_dump(const char *path);
+#else
+#define TRACE_START(t)
+#define TRACE_EVENT(ev, t)
+#define TRACE_RECORD(ty, a, t)
+#endif
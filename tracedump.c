@@ -0,0 +1,191 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Decode a trace written by xwindow: one line per record, followed by the
+ * count, mean and maximum handling time per record type. With -s, write a
+ * synthetic resize storm for xwindow -r instead. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <X11/Xlib.h>
+
+#include "arg.h"
+#include "trace.h"
+#include "util.h"
+
+#define STORMMS  2 /* between two motion steps of the storm */
+#define STORMOPS 4 /* resizes the event loop takes in one batch */
+
+char *argv0;
+
+static const char *names[] = {
+	[KeyPress] = "KeyPress",
+	[KeyRelease] = "KeyRelease",
+	[ButtonPress] = "ButtonPress",
+	[ButtonRelease] = "ButtonRelease",
+	[MotionNotify] = "MotionNotify",
+	[EnterNotify] = "EnterNotify",
+	[LeaveNotify] = "LeaveNotify",
+	[FocusIn] = "FocusIn",
+	[FocusOut] = "FocusOut",
+	[KeymapNotify] = "KeymapNotify",
+	[Expose] = "Expose",
+	[GraphicsExpose] = "GraphicsExpose",
+	[NoExpose] = "NoExpose",
+	[VisibilityNotify] = "VisibilityNotify",
+	[CreateNotify] = "CreateNotify",
+	[DestroyNotify] = "DestroyNotify",
+	[UnmapNotify] = "UnmapNotify",
+	[MapNotify] = "MapNotify",
+	[MapRequest] = "MapRequest",
+	[ReparentNotify] = "ReparentNotify",
+	[ConfigureNotify] = "ConfigureNotify",
+	[ConfigureRequest] = "ConfigureRequest",
+	[GravityNotify] = "GravityNotify",
+	[ResizeRequest] = "ResizeRequest",
+	[CirculateNotify] = "CirculateNotify",
+	[CirculateRequest] = "CirculateRequest",
+	[PropertyNotify] = "PropertyNotify",
+	[SelectionClear] = "SelectionClear",
+	[SelectionRequest] = "SelectionRequest",
+	[SelectionNotify] = "SelectionNotify",
+	[ColormapNotify] = "ColormapNotify",
+	[ClientMessage] = "ClientMessage",
+	[MappingNotify] = "MappingNotify",
+	[GenericEvent] = "GenericEvent",
+};
+
+static struct {
+	unsigned long n;
+	uint64_t sum, max;
+} stats[TraceDraw + 1];
+
+static const char *
+typename(unsigned int type)
+{
+	if (type == TraceDraw)
+		return "Draw";
+	if (type < LENGTH(names) && names[type])
+		return names[type];
+	return "?";
+}
+
+static void
+put(FILE *fp, uint64_t ts, unsigned int type, unsigned int w, unsigned int h,
+    unsigned int x, unsigned int y)
+{
+	TraceRec r = { 0 };
+
+	r.ts = ts;
+	r.type = type;
+	r.arg = w << 16 | h;
+	r.pos = x << 16 | y;
+	fwrite(&r, sizeof(r), 1, fp);
+}
+
+/* A window dragged out and back in like a user would, a triangle wave over
+ * both dimensions. Growing exposes the new right and bottom strips. */
+static void
+storm(const char *path, unsigned int n)
+{
+	TraceHdr hdr = { TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRec), 0 };
+	FILE *fp;
+	uint64_t ts;
+	unsigned int i, step, w, h, pw = 400, ph = 300;
+
+	if (!(fp = fopen(path, "wb")))
+		die("fopen '%s':", path);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (i = 0; i < n; i++) {
+		ts = (uint64_t)i * STORMMS * 1000000;
+		step = i % 400 < 200 ? i % 400 : 400 - i % 400;
+		w = 400 + 2 * step;
+		h = 300 + step;
+		put(fp, ts, ConfigureNotify, w, h, 0, 0);
+		hdr.count++;
+		if (w > pw) {
+			put(fp, ts, Expose, w - pw, h, pw, 0);
+			put(fp, ts, Expose, pw, h - ph, 0, ph);
+			hdr.count += 2;
+		}
+		if (i % STORMOPS == STORMOPS - 1) {
+			put(fp, ts, TraceDraw, 0, 0, 0, 0);
+			hdr.count++;
+		}
+		pw = w;
+		ph = h;
+	}
+	rewind(fp);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	if (ferror(fp) || fclose(fp) == EOF)
+		die("write '%s':", path);
+}
+
+static void
+usage(void)
+{
+	die("usage: %s [-s resizes] file", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	TraceHdr hdr;
+	TraceRec r;
+	FILE *fp;
+	uint64_t start = 0;
+	unsigned int i, n = 0;
+	char arg[32];
+
+	ARGBEGIN {
+	case 's':
+		n = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+		break;
+	} ARGEND
+
+	if (argc != 1)
+		usage();
+	if (n) {
+		storm(argv[0], n);
+		return EXIT_SUCCESS;
+	}
+	if (!(fp = fopen(argv[0], "rb")))
+		die("fopen '%s':", argv[0]);
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC)
+		die("%s: not a trace", argv[0]);
+	if (hdr.version != TRACE_VERSION || hdr.recsize != sizeof(TraceRec))
+		die("%s: unsupported trace version %u", argv[0], hdr.version);
+
+	printf("%12s %-16s %16s %10s\n", "ms", "type", "arg", "us");
+	for (i = 0; i < hdr.count && fread(&r, sizeof(r), 1, fp) == 1; i++) {
+		if (!i)
+			start = r.ts;
+		if (r.type == Expose)
+			snprintf(arg, sizeof(arg), "%ux%u+%u+%u", r.arg >> 16,
+			         r.arg & 0xffff, r.pos >> 16, r.pos & 0xffff);
+		else if (r.type == ConfigureNotify)
+			snprintf(arg, sizeof(arg), "%ux%u", r.arg >> 16, r.arg & 0xffff);
+		else
+			snprintf(arg, sizeof(arg), "%u", r.arg);
+		printf("%12.3f %-16s %16s %10.1f\n", (r.ts - start) / 1e6,
+		       typename(r.type), arg, r.dur / 1e3);
+		if (r.type > TraceDraw)
+			continue;
+		stats[r.type].n++;
+		stats[r.type].sum += r.dur;
+		stats[r.type].max = MAX(stats[r.type].max, r.dur);
+	}
+	if (i != hdr.count)
+		fprintf(stderr, "%s: truncated after %u of %u records\n", argv[0], i, hdr.count);
+	fclose(fp);
+
+	printf("\n%-16s %10s %10s %10s\n", "type", "count", "mean us", "max us");
+	for (i = 0; i < LENGTH(stats); i++)
+		if (stats[i].n)
+			printf("%-16s %10lu %10.1f %10.1f\n", typename(i), stats[i].n,
+			       stats[i].sum / 1e3 / stats[i].n, stats[i].max / 1e3);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,209 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Differential test of the UTF-8 fast paths in drw.c against the byte-wise
+ * versions they replaced, and an X-free microbenchmark of them with -b.
+ * drw.c is included to reach its static functions. */
+#include "drw.c"
+
+#include <time.h>
+
+#include "arg.h"
+
+static uint64_t nsnow(void);
+static long ref_decodebyte(const char c, size_t *i);
+static size_t ref_decode(const char *c, long *u, size_t clen);
+static size_t ref_printlen(const char *s);
+static int testdecode(void);
+static int testprintlen(void);
+static void bench(void);
+static void usage(void);
+
+char *argv0;
+static const unsigned char ref_utfbyte[UTF_SIZ + 1] = {0x80, 0, 0xC0, 0xE0, 0xF0};
+
+static uint64_t
+nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long
+ref_decodebyte(const char c, size_t *i)
+{
+	for (*i = 0; *i < (UTF_SIZ + 1); ++(*i))
+		if (((unsigned char)c & utfmask[*i]) == ref_utfbyte[*i])
+			return (unsigned char)c & ~utfmask[*i];
+	return 0;
+}
+
+static size_t
+ref_decode(const char *c, long *u, size_t clen)
+{
+	size_t i, j, len, type;
+	long udecoded;
+
+	*u = UTF_INVALID;
+	if (!clen)
+		return 0;
+	udecoded = ref_decodebyte(c[0], &len);
+	if (!BETWEEN(len, 1, UTF_SIZ))
+		return 1;
+	for (i = 1, j = 1; i < clen && j < len; ++i, ++j) {
+		udecoded = (udecoded << 6) | ref_decodebyte(c[i], &type);
+		if (type)
+			return j;
+	}
+	if (j < len)
+		return 0;
+	*u = udecoded;
+	utf8validate(u, len);
+
+	return len;
+}
+
+static size_t
+ref_printlen(const char *s)
+{
+	const char *p;
+
+	for (p = s; BETWEEN(*p, 0x20, 0x7e); p++)
+		;
+	return p - s;
+}
+
+/* Every three byte prefix with every length, then random four byte ones. */
+static int
+testdecode(void)
+{
+	char c[UTF_SIZ];
+	long u, ref;
+	size_t clen, n;
+	unsigned long i;
+	int fails = 0;
+
+	for (i = 0; i < 1UL << 24; i++) {
+		c[0] = i >> 16;
+		c[1] = i >> 8;
+		c[2] = i;
+		for (clen = 0; clen <= 3; clen++) {
+			n = utf8decode(c, &u, clen);
+			if (n != ref_decode(c, &ref, clen) || u != ref) {
+				if (fails++ < 10)
+					fprintf(stderr, "utf8decode %02x %02x %02x clen %zu: %zu %lx\n",
+					        c[0] & 0xff, c[1] & 0xff, c[2] & 0xff, clen, n, u);
+			}
+		}
+	}
+	srand(1);
+	for (i = 0; i < 1UL << 22; i++) {
+		for (n = 0; n < UTF_SIZ; n++)
+			c[n] = rand() >> 4;
+		c[0] |= 0xf0;
+		if (utf8decode(c, &u, UTF_SIZ) != ref_decode(c, &ref, UTF_SIZ) || u != ref) {
+			if (fails++ < 10)
+				fprintf(stderr, "utf8decode %02x %02x %02x %02x\n",
+				        c[0] & 0xff, c[1] & 0xff, c[2] & 0xff, c[3] & 0xff);
+		}
+	}
+	return fails;
+}
+
+/* Strings are allocated to their exact size, so a sanitizer catches reads
+ * past the end, and start at every offset within a word. */
+static int
+testprintlen(void)
+{
+	static const unsigned char bytes[] = { 0x01, 0x1f, 0x20, 'a', 0x7e, 0x7f, 0x80, 0xc3, 0xff };
+	char *s;
+	size_t len, i, n;
+	unsigned long iter;
+	int fails = 0;
+
+	srand(2);
+	for (iter = 0; iter < 200000; iter++) {
+		len = rand() % 80;
+		s = ecalloc(1, len + 1);
+		for (i = 0; i < len; i++)
+			s[i] = rand() % 8 ? 0x20 + rand() % 0x5f : bytes[rand() % LENGTH(bytes)];
+		for (i = 0; i <= len && i < sizeof(long); i++) {
+			n = utf8printlen(s + i, len - i);
+			if (n != ref_printlen(s + i)) {
+				if (fails++ < 10)
+					fprintf(stderr, "utf8printlen '%s' at %zu: %zu\n", s, i, n);
+			}
+		}
+		free(s);
+	}
+	return fails;
+}
+
+static void
+bench(void)
+{
+	static char s[1 << 20];
+	uint64_t t0, t1, t2;
+	size_t n = 0, i;
+	long u;
+	int r;
+
+	for (i = 0; i < sizeof(s) - 1; i++)
+		s[i] = 0x20 + i % 0x5f;
+	t0 = nsnow();
+	for (r = 0; r < 100; r++)
+		n += utf8printlen(s, sizeof(s) - 1);
+	t1 = nsnow();
+	for (r = 0; r < 100; r++)
+		n += ref_printlen(s);
+	t2 = nsnow();
+	printf("%-16s %8.3f ns/byte\n%-16s %8.3f ns/byte\n",
+	       "utf8printlen", (t1 - t0) / 100.0 / sizeof(s),
+	       "bytewise", (t2 - t1) / 100.0 / sizeof(s));
+
+	t0 = nsnow();
+	for (r = 0; r < 10; r++)
+		for (i = 0; i < sizeof(s) - 1; i += utf8decode(s + i, &u, UTF_SIZ))
+			n += u;
+	t1 = nsnow();
+	for (r = 0; r < 10; r++)
+		for (i = 0; i < sizeof(s) - 1; i += ref_decode(s + i, &u, UTF_SIZ))
+			n += u;
+	t2 = nsnow();
+	printf("%-16s %8.3f ns/byte\n%-16s %8.3f ns/byte\n",
+	       "utf8decode", (t1 - t0) / 10.0 / sizeof(s),
+	       "ref_decode", (t2 - t1) / 10.0 / sizeof(s));
+	if (!n)
+		puts(""); /* keep the results used */
+}
+
+static void
+usage(void)
+{
+	die("usage: %s [-b]", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int fails, dobench = 0;
+
+	ARGBEGIN {
+	case 'b':
+		dobench = 1;
+		break;
+	default:
+		usage();
+		break;
+	} ARGEND
+
+	if (dobench) {
+		bench();
+		return EXIT_SUCCESS;
+	}
+	fails = testdecode();
+	fails += testprintlen();
+	printf("utf8test: %s\n", fails ? "FAIL" : "ok");
+	return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,400 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "view.h"
+
+#define CHUNK      (64 * 1024)   /* stream read size */
+#define SCANCHUNK  (1024 * 1024) /* worker read size */
+#define WAKEMS     50            /* least time between two worker wakeups */
+#define POLLMS     250           /* growth check interval at the end */
+#define RESET      ((size_t)-1)  /* queued lines value, the file was truncated */
+#define TAIL       64            /* scanned bytes read again to notice rewrites */
+
+static void
+mark_add(View *v, size_t off)
+{
+	if (v->nmarks == v->marksize) {
+		v->marksize = MAX(64, v->marksize * 2);
+		v->marks = erealloc(v->marks, v->marksize * sizeof(size_t));
+	}
+	v->marks[v->nmarks++] = off;
+}
+
+/* Open a file, or standard input for "-". Regular files are mapped, nothing
+ * is read before it is shown. */
+View *
+view_open(const char *path, size_t max)
+{
+	View *v = ecalloc(1, sizeof(View));
+	struct stat st;
+
+	if (!strcmp(path, "-"))
+		v->fd = STDIN_FILENO;
+	else if ((v->fd = open(path, O_RDONLY)) < 0)
+		die("open '%s':", path);
+	if (fstat(v->fd, &st) < 0)
+		die("fstat '%s':", path);
+
+	if (S_ISREG(st.st_mode)) {
+		v->eof = 1;
+		v->len = st.st_size;
+		if (v->len && (v->buf = mmap(NULL, v->len, PROT_READ, MAP_PRIVATE, v->fd, 0)) == MAP_FAILED)
+			die("mmap '%s':", path);
+		if (v->len)
+			posix_madvise(v->buf, v->len, POSIX_MADV_SEQUENTIAL);
+	} else {
+		v->max = MAX(max, 2 * CHUNK);
+		if (fcntl(v->fd, F_SETFL, fcntl(v->fd, F_GETFL) | O_NONBLOCK) < 0)
+			die("fcntl:");
+	}
+	mark_add(v, 0);
+	return v;
+}
+
+void
+view_close(View *v)
+{
+	if (!v)
+		return;
+	if (v->async) {
+		__atomic_store_n(&v->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(v->worker, NULL);
+		close(v->evfd);
+	}
+	if (v->size)
+		free(v->buf);
+	else if (v->len)
+		munmap(v->buf, v->len);
+	if (v->fd != STDIN_FILENO)
+		close(v->fd);
+	free(v->marks);
+	free(v);
+}
+
+static void
+sleepms(long ms)
+{
+	struct timespec ts = { ms / 1000, ms % 1000 * 1000000 };
+
+	nanosleep(&ts, NULL);
+}
+
+static void
+wake(View *v)
+{
+	uint64_t one = 1;
+
+	if (write(v->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		die("write:");
+}
+
+/* Queue that line starts at off, waits while the loop is behind. */
+static int
+push(View *v, size_t off, size_t lines)
+{
+	unsigned long head = v->qhead;
+
+	while (head - __atomic_load_n(&v->qtail, __ATOMIC_ACQUIRE) == VIEW_QUEUE) {
+		if (__atomic_load_n(&v->stop, __ATOMIC_ACQUIRE))
+			return -1;
+		wake(v);
+		sleepms(1);
+	}
+	v->queue[head % VIEW_QUEUE].off = off;
+	v->queue[head % VIEW_QUEUE].lines = lines;
+	__atomic_store_n(&v->qhead, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Scan the file with its own reads, so the loop can remap it at any time.
+ * Queues every mark and the progress after each read, then polls the size
+ * once at the end, like tail -f. Each read starts with the last bytes already
+ * scanned, if they changed the file was truncated and written again. */
+static void *
+worker(void *arg)
+{
+	View *v = arg;
+	char *buf = ecalloc(1, SCANCHUNK + TAIL), *data, *p, *q, tail[TAIL];
+	size_t off = 0, start = 0, lines = 0, skip;
+	struct timespec now, then = { 0 };
+	ssize_t n;
+
+	while (!__atomic_load_n(&v->stop, __ATOMIC_ACQUIRE)) {
+		skip = MIN(off, TAIL);
+		if ((n = pread(v->fd, buf, SCANCHUNK + skip, off - skip)) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("pread:");
+		}
+		if ((size_t)n < skip || memcmp(buf, tail + TAIL - skip, skip)) {
+			/* truncated, start over like tail -f */
+			off = start = lines = 0;
+			if (push(v, 0, RESET) < 0)
+				break;
+			wake(v);
+			continue;
+		}
+		if (!(n -= skip)) {
+			if (!v->caughtup) {
+				__atomic_store_n(&v->caughtup, 1, __ATOMIC_RELEASE);
+				wake(v);
+			}
+			sleepms(POLLMS);
+			continue;
+		}
+		if (v->caughtup)
+			__atomic_store_n(&v->caughtup, 0, __ATOMIC_RELEASE);
+		data = buf + skip;
+		for (p = data; (q = memchr(p, '\n', data + n - p)); p = q + 1) {
+			start = off + (q + 1 - data);
+			if (++lines % VIEW_MARK == 0 && push(v, start, lines) < 0)
+				goto out;
+		}
+		off += n;
+		if (n >= TAIL)
+			memcpy(tail, data + n - TAIL, TAIL);
+		else {
+			memmove(tail, tail + n, TAIL - n);
+			memcpy(tail + TAIL - n, data, n);
+		}
+		if (push(v, start, lines) < 0)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - then.tv_sec) * 1000 + (now.tv_nsec - then.tv_nsec) / 1000000 >= WAKEMS) {
+			wake(v);
+			then = now;
+		}
+	}
+out:
+	free(buf);
+	return NULL;
+}
+
+/* Index a mapped file in the background from now on. Returns the descriptor
+ * to poll for view_update(), or -1 if there is nothing to index. */
+int
+view_start(View *v)
+{
+	if (v->max)
+		return -1;
+	if ((v->evfd = eventfd(0, EFD_NONBLOCK)) < 0)
+		die("eventfd:");
+	v->async = 1;
+	if ((errno = pthread_create(&v->worker, NULL, worker, v)))
+		die("pthread_create:");
+	return v->evfd;
+}
+
+/* Map the file again if its size changed, the old mapping faults past the
+ * new end. Drops the index if the file no longer holds it, the worker starts
+ * over once it notices. Returns 1 if it did. */
+static int
+remap(View *v)
+{
+	struct stat st;
+
+	if (fstat(v->fd, &st) < 0)
+		die("fstat:");
+	if ((size_t)st.st_size == v->len)
+		return 0;
+	if (v->len)
+		munmap(v->buf, v->len);
+	v->buf = NULL;
+	v->len = st.st_size;
+	if (v->len && (v->buf = mmap(NULL, v->len, PROT_READ, MAP_PRIVATE, v->fd, 0)) == MAP_FAILED)
+		die("mmap:");
+	if (v->indexed <= v->len)
+		return 0;
+	v->indexed = v->lines = 0;
+	v->nmarks = 1;
+	return 1;
+}
+
+/* Take the worker progress and map the file again if its size changed.
+ * Returns 1 if the file was truncated and the index started over. */
+int
+view_update(View *v)
+{
+	unsigned long tail = v->qtail, head;
+	uint64_t n;
+	int reset = 0;
+
+	if (read(v->evfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		die("read:");
+	head = __atomic_load_n(&v->qhead, __ATOMIC_ACQUIRE);
+	for (; tail != head; tail++) {
+		if (v->queue[tail % VIEW_QUEUE].lines == RESET) {
+			v->indexed = v->lines = 0;
+			v->nmarks = 1;
+			reset = 1;
+			continue;
+		}
+		v->indexed = v->queue[tail % VIEW_QUEUE].off;
+		v->lines = v->queue[tail % VIEW_QUEUE].lines;
+		if (v->lines % VIEW_MARK == 0 && v->lines / VIEW_MARK == v->nmarks)
+			mark_add(v, v->indexed);
+	}
+	__atomic_store_n(&v->qtail, tail, __ATOMIC_RELEASE);
+
+	/* after the queue, so the mapping covers all indexed bytes */
+	return remap(v) || reset;
+}
+
+static void view_index(View *v, size_t line);
+
+/* Drop the older half of the stream buffer, cut at an index mark so the line
+ * numbers stay exact. */
+static void
+view_trim(View *v)
+{
+	size_t i, off;
+
+	view_index(v, -1);
+	for (i = 1; i < v->nmarks && v->marks[i] < v->len / 2; i++)
+		;
+	if (i == v->nmarks)
+		i--;
+	if (i) {
+		off = v->marks[i];
+		v->indexed -= off;
+		v->first += i * VIEW_MARK;
+		v->lines -= i * VIEW_MARK;
+		v->nmarks -= i;
+		memmove(v->marks, v->marks + i, v->nmarks * sizeof(size_t));
+		for (i = 0; i < v->nmarks; i++)
+			v->marks[i] -= off;
+	} else {
+		/* less than VIEW_MARK huge lines, the numbering restarts */
+		off = v->len / 2;
+		v->indexed = v->lines = 0;
+		v->nmarks = 1;
+	}
+	memmove(v->buf, v->buf + off, v->len - off);
+	v->len -= off;
+}
+
+/* Read what is available from a stream. Returns the bytes read, 0 at end of
+ * file and -1 if nothing is available. */
+ssize_t
+view_read(View *v)
+{
+	ssize_t n;
+
+	if (v->eof)
+		return 0;
+	if (v->len + CHUNK > v->size) {
+		if (v->len + CHUNK > v->max)
+			view_trim(v);
+		if (v->len + CHUNK > v->size) {
+			v->size = MIN(MAX(v->size * 2, v->len + CHUNK), MAX(v->max, v->len + CHUNK));
+			v->buf = erealloc(v->buf, v->size);
+		}
+	}
+	if ((n = read(v->fd, v->buf + v->len, CHUNK)) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return -1;
+		die("read:");
+	}
+	if (!n)
+		v->eof = 1;
+	v->len += n;
+	return n;
+}
+
+/* Index the buffer until the mark for line is known or the data ends. */
+static void
+view_index(View *v, size_t line)
+{
+	const char *p, *end = v->buf + v->len;
+
+	if (v->async)
+		return;
+	while ((line - v->first) / VIEW_MARK >= v->nmarks && v->indexed < v->len) {
+		if (!(p = memchr(v->buf + v->indexed, '\n', v->len - v->indexed))) {
+			/* an unterminated last line is indexed once complete */
+			if (!v->eof)
+				return;
+			p = end - 1;
+		}
+		v->indexed = p + 1 - v->buf;
+		if (++v->lines % VIEW_MARK == 0 && v->indexed < v->len)
+			mark_add(v, v->indexed);
+	}
+}
+
+/* Return the offset of a line, which is clamped to the lines available. */
+size_t
+view_seek(View *v, size_t *line)
+{
+	const char *p;
+	size_t i, n, off;
+
+	if (*line < v->first)
+		*line = v->first;
+	/* the file may have shrunk since the last update, never scan past
+	 * what the worker indexed */
+	if (v->async) {
+		remap(v);
+		*line = MIN(*line, v->first + v->lines);
+	}
+	view_index(v, *line);
+	i = MIN((*line - v->first) / VIEW_MARK, v->nmarks - 1);
+	off = v->marks[i];
+	for (n = v->first + i * VIEW_MARK; n < *line && off < v->len; n++) {
+		if (!(p = memchr(v->buf + off, '\n', v->len - off)) || p + 1 == v->buf + v->len)
+			break;
+		off = p + 1 - v->buf;
+	}
+	*line = n;
+	return off;
+}
+
+/* Return the length of the line at off without the newline and the offset of
+ * the next line, or len if there is none. */
+size_t
+view_line(View *v, size_t off, size_t *len)
+{
+	const char *p;
+
+	if (off >= v->len) {
+		*len = 0;
+		return v->len;
+	}
+	if (!(p = memchr(v->buf + off, '\n', v->len - off))) {
+		*len = v->len - off;
+		return v->len;
+	}
+	*len = p - (v->buf + off);
+	return p + 1 - v->buf;
+}
+
+/* Count the lines known so far. Returns 1 if that is all of them. */
+int
+view_lines(View *v, size_t *n)
+{
+	int done;
+
+	if (!v->async) {
+		view_index(v, -1);
+		*n = v->first + v->lines;
+		return v->eof;
+	}
+	done = __atomic_load_n(&v->caughtup, __ATOMIC_ACQUIRE) &&
+	       v->qtail == __atomic_load_n(&v->qhead, __ATOMIC_ACQUIRE);
+	/* the worker only counts terminated lines */
+	*n = v->lines + (done && v->indexed < v->len);
+	return done;
+}
@@ -0,0 +1,39 @@
+/* See LICENSE file for copyright and license details. */
+
+#define VIEW_MARK  1024 /* lines between two index marks */
+#define VIEW_QUEUE 1024 /* index updates in flight from the worker */
+
+/* A file or stream shown in the window. Regular files are mapped, streams are
+ * read into a buffer that drops its oldest half when it gets too large. Only
+ * every VIEW_MARK-th line start is indexed, and only as far as needed, or for
+ * a started file by a worker thread that follows it as it grows. */
+typedef struct {
+	int fd;
+	char *buf;          /* mapping or stream buffer */
+	size_t len;         /* bytes available */
+	size_t size;        /* stream buffer size, 0 for mappings */
+	size_t max;         /* stream buffer limit */
+	int eof;
+	size_t *marks;      /* offset of line first + i * VIEW_MARK */
+	size_t nmarks, marksize;
+	size_t first;       /* first line still in the buffer */
+	size_t indexed;     /* bytes scanned for marks */
+	size_t lines;       /* lines in the scanned bytes */
+
+	/* worker thread, the queue has a single producer and consumer */
+	int async;
+	int evfd;           /* readable when the worker made progress */
+	int stop, caughtup;
+	pthread_t worker;
+	unsigned long qhead, qtail;
+	struct { size_t off, lines; } queue[VIEW_QUEUE]; /* line starts */
+} View;
+
+View *view_open(const char *path, size_t max);
+void view_close(View *v);
+int view_start(View *v);
+int view_update(View *v);
+int view_lines(View *v, size_t *n);
+ssize_t view_read(View *v);
+size_t view_seek(View *v, size_t *line);
+size_t view_line(View *v, size_t off, size_t *len);
@@ -1,29 +1,43 @@
 /* See LICENSE file for copyright and license details. */
 #include <sys/types.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <X11/XKBlib.h>
+#include <X11/extensions/XShm.h>
 #include <X11/Xft/Xft.h>
 
 #include "arg.h"
 #include "util.h"
 #include "drw.h"
+#include "stats.h"
+#include "trace.h"
+#include "view.h"
 
 char *argv0;
 
 /* macros */
-#define LENGTH(X)         (sizeof(X) / sizeof(X)[0])
-#define TEXTW(X)          (drw_fontset_getwidth(drw, (X)) + lrpad)
+#define TEXTW(X)          (drw_fontset_getwidth_cached(drw, (X)) + lrpad)
 
 /* enums */
 enum { SchemeNorm, SchemeBar }; /* color schemes */
 enum { WMDelete, WMName, WMLast }; /* atoms */
+enum { FrameFull, FramePartial, FrameSkipped, FrameLast }; /* frame counters */
+enum { PollX, PollClock, PollSignal, PollStats, PollView, PollIndex, PollFeed, PollFrame, PollLast }; /* event loop file descriptors */
 
 /* types and structs */
 typedef union {
@@ -45,14 +59,36 @@ typedef struct {
 	const Arg arg;
 } Shortcut;
 
+static void armclock(void);
+static void checkbindings(void);
 static void cleanup(void);
+static void dumptrace(void);
+static int fmtinterval(const char *fmt);
+static double msince(const struct timespec *t);
+static uint64_t nsnow(void);
+static void printstats(void);
+static void statsline(FILE *fp);
+static void initcolors(void);
+static void initfonts(void);
+static void phase(const char *name);
+static int flushbatch(void);
+static int readfeed(void);
+static void renderppm(const char *path);
+static void replay(const char *path);
 static void run(void);
 static void usage(void);
 static void xhints(void);
 static void setup(void);
+static void setupmem(void);
 static void drawbar(void);
+static void drawview(void);
+static void exposearea(int x, int y, int w, int h);
+static void updatebindings(void);
 
 static void quit(const Arg *arg);
+static void scroll(const Arg *arg);
+static void scrollpage(const Arg *arg);
+static void scrollto(const Arg *arg);
 static void togglebar(const Arg *arg);
 
 /* X events */
@@ -61,19 +97,72 @@ static void clientmessage(XEvent *e);
 static void expose(XEvent *e);
 static void keypress(XEvent *e);
 static void configurenotify(XEvent *e);
+static void mappingnotify(XEvent *e);
 
 /* variables */
+static char *atomnames[WMLast] = {
+	[WMDelete] = "WM_DELETE_WINDOW",
+	[WMName]   = "_NET_WM_NAME",
+};
 static Atom atoms[WMLast];
 static Clr **scheme;
 static Drw *drw;
 static Display *dpy;
 static Window win;
 static char right[128], left[128]; /* bar buf */
+static struct {
+	char left[128], right[128];
+	int w, h;      /* w == 0 means nothing is rendered */
+	Clr *scm;
+} drawn;                /* last rendered bar */
+static unsigned long frames[FrameLast];
+static unsigned long resizes;
 static int bh = 0;      /* bar geometry */
+static int debug = 0;   /* synchronous X requests */
+static int redraw = 0;  /* drawbar on the next loop iteration */
+static int resized = 0; /* drw_resize on the next loop iteration */
+static struct {
+	int x0, y0, x1, y1;
+} damage;               /* union of exposed areas, empty if x0 >= x1 */
+static int clockfd = -1;
+static int sigfd = -1;  /* SIGUSR1 dumps the trace */
+static int statsfd = -1;
+static int showstats = 0;
+static int feedfd = -1;   /* status records for the bar, see readfeed() */
+static int framefd = -1;  /* caps the frames for feed records at maxfps */
+static int framearmed;
+static int feedpending;   /* a record is not rendered yet */
+static uint64_t feedframe; /* ns of the last frame for the feed */
+static char feed[2][128]; /* latest left and right text */
+static int feedset[2];
+static unsigned long feedrecords, feedframes;
+static struct {
+	unsigned long events;
+	Hist handler[LASTEvent]; /* ns per event type */
+	Hist render;             /* ns per drawbar */
+	Hist requests;           /* X requests per frame */
+	Hist input;              /* ns from reading input to presenting */
+	Hist eventage;           /* ns from the server timestamp to presenting */
+} stats;
+#ifdef TRACE
+static const char *tracefile;
+#endif
+static int clockinterval; /* seconds the time format changes at */
 static int running = 1;
 static int lrpad;       /* sum of left and right padding for text */
 static int winw, winh;  /* window size */
 static int winy;        /* window height - bar height */
+static View *view;      /* content shown above the bar */
+static size_t top;      /* first visible line */
+static int viewdirty;   /* the content needs rendering */
+static int follow;      /* keep the last page visible as the file grows */
+static int indexfd = -1; /* view worker progress */
+static struct timespec starttime;
+static int timing = 0;  /* print the startup phases */
+static double firstframe = -1;  /* ms until the first frame reached the window */
+static unsigned long firstsyncs; /* drw syncs until then */
+static const Shortcut *keys[256];     /* shortcut by keycode */
+static const Mousekey *buttons[256];  /* mouse shortcut by button */
 
 /* config.h for applying patches and the configuration. */
 #include "config.h"
@@ -84,8 +173,150 @@ static void (*handler[LASTEvent])(XEvent *e) = {
 	[ConfigureNotify] = configurenotify,
 	[Expose] = expose,
 	[KeyPress] = keypress,
+	[MappingNotify] = mappingnotify,
 };
 
+/* Return the interval in seconds the output of a strftime(3) format changes
+ * at, the largest interval considered is a day. */
+int
+fmtinterval(const char *fmt)
+{
+	const char *p;
+	int i = 24 * 60 * 60;
+
+	for (p = fmt; (p = strchr(p, '%')) && p[1]; p += 2) {
+		if ((p[1] == 'E' || p[1] == 'O') && p[2])
+			p++;
+		switch (p[1]) {
+		case 'c': case 'r': case 's': case 'S': case 'T': case 'X': case '+':
+			return 1;
+		case 'M': case 'R':
+			i = MIN(i, 60);
+			break;
+		case 'H': case 'I': case 'k': case 'l': case 'p': case 'P':
+			i = MIN(i, 60 * 60);
+			break;
+		}
+	}
+	return i;
+}
+
+double
+msince(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+uint64_t
+nsnow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Dump all counters and histograms, for -S. */
+void
+printstats(void)
+{
+	static const char *names[LASTEvent] = {
+		[ButtonPress] = "ButtonPress",
+		[ClientMessage] = "ClientMessage",
+		[ConfigureNotify] = "ConfigureNotify",
+		[Expose] = "Expose",
+		[KeyPress] = "KeyPress",
+		[MappingNotify] = "MappingNotify",
+	};
+	unsigned int i;
+
+	fprintf(stderr, "frames: %lu full, %lu partial, %lu skipped\n",
+	        frames[FrameFull], frames[FramePartial], frames[FrameSkipped]);
+	fprintf(stderr, "first frame: %.2f ms, %lu syncs\n", firstframe, firstsyncs);
+	fprintf(stderr, "events: %lu, requests: %lu\n", stats.events, NextRequest(dpy) - 1);
+	if (feedrecords)
+		fprintf(stderr, "feed: %lu records, %lu frames\n", feedrecords, feedframes);
+	drw_stats(drw, stderr);
+
+	fprintf(stderr, "%-16s %8s %10s %10s %10s %10s %10s\n",
+	        "time in us", "count", "mean", "p50", "p90", "p99", "max");
+	for (i = 0; i < LASTEvent; i++)
+		if (stats.handler[i].count)
+			hist_print(&stats.handler[i], names[i] ? names[i] : "other", 1e3, stderr);
+	hist_print(&stats.render, "render", 1e3, stderr);
+	hist_print(&stats.input, "input latency", 1e3, stderr);
+	hist_print(&stats.eventage, "event latency", 1e3, stderr);
+	hist_print(&stats.requests, "requests/frame", 1, stderr);
+}
+
+/* Print the counters as one line of key=value pairs, times in microseconds. */
+void
+statsline(FILE *fp)
+{
+	fprintf(fp, "stats time=%ld frames=%lu partial=%lu skipped=%lu events=%lu "
+	        "requests=%lu syncs=%lu render_p50=%lu render_p99=%lu render_max=%lu "
+	        "input_p50=%lu input_p99=%lu input_max=%lu requests_p50=%lu requests_max=%lu\n",
+	        (long)time(NULL), frames[FrameFull], frames[FramePartial], frames[FrameSkipped],
+	        stats.events, NextRequest(dpy) - 1, drw->syncs,
+	        (unsigned long)hist_percentile(&stats.render, 50) / 1000,
+	        (unsigned long)hist_percentile(&stats.render, 99) / 1000,
+	        (unsigned long)stats.render.max / 1000,
+	        (unsigned long)hist_percentile(&stats.input, 50) / 1000,
+	        (unsigned long)hist_percentile(&stats.input, 99) / 1000,
+	        (unsigned long)stats.input.max / 1000,
+	        (unsigned long)hist_percentile(&stats.requests, 50),
+	        (unsigned long)stats.requests.max);
+	fflush(fp);
+}
+
+/* Print the time spent in a startup phase with -T. */
+void
+phase(const char *name)
+{
+	static double last;
+	double now;
+
+	if (!timing)
+		return;
+	now = msince(&starttime);
+	fprintf(stderr, "startup: %-12s %8.2f ms %8.2f ms total\n", name, now - last, now);
+	last = now;
+}
+
+/* Arm the clock timer for the next wall clock boundary the bar text changes
+ * at. The timer is cancelled when the system clock is set, which rearms it. */
+void
+armclock(void)
+{
+	struct itimerspec its = { 0 };
+	struct tm tm;
+	time_t now;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	if (clockinterval < 60) {
+		its.it_value.tv_sec = now + 1;
+	} else {
+		tm.tm_sec = 0;
+		if (clockinterval < 60 * 60) {
+			tm.tm_min++;
+		} else if (clockinterval < 24 * 60 * 60) {
+			tm.tm_min = 0;
+			tm.tm_hour++;
+		} else {
+			tm.tm_min = tm.tm_hour = 0;
+			tm.tm_mday++;
+		}
+		tm.tm_isdst = -1;
+		its.it_value.tv_sec = mktime(&tm);
+	}
+	if (timerfd_settime(clockfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0)
+		die("timerfd_settime:");
+}
+
 void
 cleanup(void)
 {
@@ -94,18 +325,71 @@ cleanup(void)
 	for (i = 0; i < LENGTH(colors); i++)
 		free(scheme[i]);
 	free(scheme);
+	if (showstats)
+		printstats();
 	drw_free(drw);
+	close(clockfd);
+	if (framefd >= 0)
+		close(framefd);
+	if (feedfd > STDIN_FILENO)
+		close(feedfd);
+	if (statsfd >= 0)
+		close(statsfd);
+	dumptrace();
+	if (sigfd >= 0)
+		close(sigfd);
 	XDestroyWindow(dpy, win);
 	XSync(dpy, False);
 	XCloseDisplay(dpy);
 }
 
+void
+dumptrace(void)
+{
+#ifdef TRACE
+	if (tracefile && trace_dump(tracefile) < 0)
+		fprintf(stderr, "xwindow: cannot write trace '%s'\n", tracefile);
+#endif
+}
+
 void
 quit(const Arg *arg)
 {
 	running = 0;
 }
 
+void
+scroll(const Arg *arg)
+{
+	if (!view)
+		return;
+	if (arg->i < 0) {
+		top -= MIN(top, (size_t)-arg->i);
+		follow = 0;
+	} else
+		top += arg->i;
+	viewdirty = redraw = 1;
+}
+
+void
+scrollpage(const Arg *arg)
+{
+	Arg a = { .i = arg->i * MAX((winh - bh) / (int)drw->fonts->h - 1, 1) };
+
+	scroll(&a);
+}
+
+/* Scroll to the start, or the end for a negative argument. */
+void
+scrollto(const Arg *arg)
+{
+	if (!view)
+		return;
+	top = arg->i < 0 ? (size_t)-1 : 0;
+	follow = arg->i < 0;
+	viewdirty = redraw = 1;
+}
+
 void
 togglebar(const Arg *arg)
 {
@@ -114,56 +398,421 @@ togglebar(const Arg *arg)
 		bh = drw->fonts->h + 2; /* two pixel padding */
 	else
 		bh = 0;
+	resized = 1;
+	viewdirty = 1;
 	XClearWindow(dpy, win);
-	drawbar();
+	exposearea(0, 0, winw, winh);
 }
 
 void
 drawbar(void)
 {
-	int tw = 0;
+	int tw = 0, full, dirtyleft, dirtyright;
+	int by; /* bar position in the backing store */
 
 	winy = winh - bh;
+	by = view ? winy : 0;
 
 	if (!showbar)
 		return;
 
-	drw_setscheme(drw, scheme[SchemeBar]);
-
 	/* left text */
 	struct timeval tv;
 	time_t t;
 	struct tm *info;
 	char buffer[64];
 
-	gettimeofday(&tv, NULL);
-	t = tv.tv_sec;
-	info = localtime(&t);
-	strftime(buffer, sizeof(buffer), "Today is %A, %B %d..", info);
-
-	snprintf(left, LENGTH(left), "%s", buffer);
-	drw_text(drw, 0, winy, winw / 2, bh, lrpad / 2, left, 0);
+	if (feedset[0]) {
+		memcpy(left, feed[0], sizeof(left));
+	} else {
+		gettimeofday(&tv, NULL);
+		t = tv.tv_sec;
+		info = localtime(&t);
+		strftime(buffer, sizeof(buffer), timefmt, info);
+		snprintf(left, LENGTH(left), "%s", buffer);
+	}
 
-	/* right text */
+	/* right text, the position while a file is still being indexed is
+	 * marked with a plus */
 	char str[] = "..And is a good day!";
-	snprintf(right, LENGTH(right), "%s", str);
-	tw = TEXTW(right) - lrpad + 2; /* 2px right padding */
-	drw_text(drw, winw/2, winy, winw/2, bh, winw/2 - (tw + lrpad / 2), right, 0);
+	size_t nlines;
+	int done;
+
+	if (feedset[1]) {
+		memcpy(right, feed[1], sizeof(right));
+	} else if (view) {
+		done = view_lines(view, &nlines);
+		snprintf(right, LENGTH(right), "%zu/%zu%s", MIN(top + 1, nlines),
+		         nlines, done ? "" : "+");
+	} else {
+		snprintf(right, LENGTH(right), "%s", str);
+	}
+
+	/* only render the halves that changed since the last frame */
+	full = drawn.w != winw || drawn.h != bh || drawn.scm != scheme[SchemeBar];
+	dirtyleft = full || strcmp(left, drawn.left);
+	dirtyright = full || strcmp(right, drawn.right);
+
+	drw_setscheme(drw, scheme[SchemeBar]);
+	drw_frame_begin(drw);
+	if (dirtyleft)
+		drw_text(drw, 0, by, winw / 2, bh, lrpad / 2, left, 0);
+	if (dirtyright) {
+		tw = TEXTW(right) - lrpad + 2; /* 2px right padding */
+		drw_text(drw, winw/2, by, winw/2, bh, winw/2 - (tw + lrpad / 2), right, 0);
+	}
+	drw_frame_end(drw);
+
+	if (dirtyleft && dirtyright)
+		frames[FrameFull]++;
+	else if (dirtyleft || dirtyright)
+		frames[FramePartial]++;
+	else
+		frames[FrameSkipped]++;
+
+	memcpy(drawn.left, left, sizeof(left));
+	memcpy(drawn.right, right, sizeof(right));
+	drawn.w = winw;
+	drawn.h = bh;
+	drawn.scm = scheme[SchemeBar];
 
-	drw_map(drw, win, 0, winy, winw, bh);
+	/* copy what was rendered or exposed, without content the pixmap only
+	 * holds the bar */
+	if (dirtyleft || dirtyright) {
+		drw_map(drw, win, 0, by, winw, bh, 0, winy);
+	} else if (damage.x0 < damage.x1 && damage.y1 > winy) {
+		damage.y0 = MAX(damage.y0, winy);
+		drw_map(drw, win, damage.x0, damage.y0 - winy + by,
+		        damage.x1 - damage.x0, damage.y1 - damage.y0, damage.x0, damage.y0);
+	}
+}
+
+/* Render the visible lines above the bar, or copy the exposed part of them.
+ * Only whole lines are drawn, the rest is background. */
+void
+drawview(void)
+{
+	char buf[512];
+	size_t i, len, line, off, next;
+	int y, lh, rows;
+
+	if (!view)
+		return;
+
+	winy = winh - bh;
+	lh = drw->fonts->h;
+	rows = MAX(winy / lh, 1);
+	if (viewdirty) {
+		viewdirty = 0;
+		line = top;
+		off = view_seek(view, &line);
+		/* past the end, show the last page */
+		if (line < top && line > view->first) {
+			top = line - MIN(line - view->first, (size_t)rows - 1);
+			off = view_seek(view, &top);
+		} else {
+			top = line;
+		}
+
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		drw_frame_begin(drw);
+		for (y = 0; y + lh <= winy && off < view->len; y += lh, off = next) {
+			next = view_line(view, off, &len);
+			len = MIN(len, sizeof(buf) - 1);
+			for (i = 0; i < len; i++)
+				buf[i] = (unsigned char)view->buf[off + i] < ' ' ? ' ' : view->buf[off + i];
+			buf[len] = '\0';
+			drw_text(drw, 0, y, winw, lh, lrpad / 2, buf, 0);
+		}
+		if (y < winy)
+			drw_rect(drw, 0, y, winw, winy - y, 1, 1);
+		drw_frame_end(drw);
+		drw_map(drw, win, 0, 0, winw, winy, 0, 0);
+	} else if (damage.x0 < damage.x1 && damage.y0 < winy) {
+		drw_map(drw, win, damage.x0, damage.y0, damage.x1 - damage.x0,
+		        MIN(damage.y1, winy) - damage.y0, damage.x0, damage.y0);
+	}
+}
+
+/* Copy a feed segment, returns 1 if it changed. */
+static int
+setfeed(int i, const char *s, size_t n)
+{
+	char buf[sizeof(feed[0])];
+	size_t j;
+
+	n = MIN(n, sizeof(buf) - 1);
+	for (j = 0; j < n; j++)
+		buf[j] = (unsigned char)s[j] < ' ' ? ' ' : s[j];
+	buf[n] = '\0';
+	feedset[i] = 1;
+	if (!strcmp(buf, feed[i]))
+		return 0;
+	memcpy(feed[i], buf, n + 1);
+	return 1;
+}
+
+/* Read a bounded batch from the feed. Records are lines of left and right
+ * text separated by a tab, a line without one only sets the left text. Only
+ * the last record of each segment is kept, so a fast producer costs reads
+ * but no frames. Returns 1 if a segment changed. */
+int
+readfeed(void)
+{
+	static char buf[16 * 1024];
+	static size_t len;
+	static int skip; /* dropping a line longer than buf */
+	char *p, *s, *e, *end, *tab;
+	ssize_t n;
+	int i, seen, changed = 0;
+
+	for (i = 0; i < 16 && feedfd >= 0; i++) {
+		if ((n = read(feedfd, buf + len, sizeof(buf) - len)) < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			die("read:");
+		}
+		if (!n) {
+			if (feedfd != STDIN_FILENO)
+				close(feedfd);
+			feedfd = -1;
+			break;
+		}
+		for (p = buf + len; (p = memchr(p, '\n', buf + len + n - p)); p++)
+			feedrecords++;
+		len += n;
+		if (skip) {
+			if (!(p = memchr(buf, '\n', len))) {
+				len = 0;
+				continue;
+			}
+			skip = 0;
+			len -= p + 1 - buf;
+			memmove(buf, p + 1, len);
+		}
+
+		/* walk back from the last complete record until both segments
+		 * are set */
+		for (end = buf + len; end > buf && end[-1] != '\n'; end--)
+			;
+		if (end == buf) {
+			if (len == sizeof(buf)) {
+				skip = 1;
+				len = 0;
+			}
+			continue;
+		}
+		seen = 0;
+		for (e = end - 1; seen != 3; e = s - 1) {
+			for (s = e; s > buf && s[-1] != '\n'; s--)
+				;
+			tab = memchr(s, '\t', e - s);
+			if (!(seen & 1))
+				changed |= setfeed(0, s, (tab ? tab : e) - s);
+			if (tab && !(seen & 2))
+				changed |= setfeed(1, tab + 1, e - tab - 1);
+			seen |= tab ? 3 : 1;
+			if (s == buf)
+				break;
+		}
+		len -= end - buf;
+		memmove(buf, end, len);
+	}
+	return changed;
+}
+
+/* Add an area to the damage that needs to be copied to the window. */
+void
+exposearea(int x, int y, int w, int h)
+{
+	if (damage.x0 < damage.x1) {
+		damage.x0 = MIN(damage.x0, x);
+		damage.y0 = MIN(damage.y0, y);
+		damage.x1 = MAX(damage.x1, x + w);
+		damage.y1 = MAX(damage.y1, y + h);
+	} else {
+		damage.x0 = x;
+		damage.y0 = y;
+		damage.x1 = x + w;
+		damage.y1 = y + h;
+	}
+	redraw = 1;
+}
+
+/* Collapse what a batch of events changed into at most one resize and one
+ * frame. Returns 1 if a frame was rendered. */
+int
+flushbatch(void)
+{
+	uint64_t t0;
+	unsigned long req;
+
+	if (resized) {
+		resized = 0;
+		resizes++;
+		drw_resize(drw, winw, view ? winh : bh);
+		drawn.w = 0; /* the pixmap contents may be gone */
+		viewdirty = 1;
+		/* without content nothing covers what the bit gravity moved */
+		if (dpy && !view)
+			XClearWindow(dpy, win);
+		exposearea(0, 0, winw, winh);
+	}
+	if (!redraw)
+		return 0;
+	TRACE_START(t);
+	t0 = nsnow();
+	req = dpy ? NextRequest(dpy) : 0;
+	redraw = 0;
+	drawview();
+	drawbar();
+	/* both copied their part, also without a bar */
+	damage.x0 = damage.x1 = 0;
+	hist_add(&stats.render, nsnow() - t0);
+	hist_add(&stats.requests, (dpy ? NextRequest(dpy) : 0) - req);
+	TRACE_RECORD(TraceDraw, 0, t);
+	return 1;
 }
 
 void
 run(void)
 {
 	XEvent ev;
+	struct pollfd pfd[PollLast] = {
+		[PollX]     = { .fd = ConnectionNumber(dpy), .events = POLLIN },
+		[PollClock] = { .fd = clockfd,               .events = POLLIN },
+		[PollSignal] = { .fd = sigfd,                .events = POLLIN },
+		[PollStats] = { .fd = statsfd,               .events = POLLIN },
+		[PollView] = { .fd = view && !view->eof ? view->fd : -1, .events = POLLIN },
+		[PollIndex] = { .fd = indexfd,               .events = POLLIN },
+		[PollFeed]  = { .fd = feedfd,                .events = POLLIN },
+		[PollFrame] = { .fd = framefd,               .events = POLLIN },
+	};
+	ssize_t n;
+	size_t nlines;
+	struct signalfd_siginfo si;
+	uint64_t expirations, t0, inputstart = 0;
+	unsigned int i;
+	Time inputtime = 0;
+	int drew;
+	struct itimerspec its = { 0 };
 
-	XSync(dpy, False);
 	/* main event loop */
 	while (running) {
-		XNextEvent(dpy, &ev);
-		if (handler[ev.type])
-			handler[ev.type](&ev); /* call handler */
+		/* handle what was read without flushing in between */
+		while (running && XEventsQueued(dpy, QueuedAfterReading)) {
+			XNextEvent(dpy, &ev);
+			/* extension events such as ShmCompletion go to drw */
+			if (ev.type >= LASTEvent) {
+				drw_handleevent(drw, &ev);
+			} else if (handler[ev.type]) {
+				TRACE_START(t);
+				t0 = nsnow();
+				handler[ev.type](&ev); /* call handler */
+				hist_add(&stats.handler[ev.type], nsnow() - t0);
+				TRACE_EVENT(&ev, t);
+				stats.events++;
+				/* input latency is measured to the next frame */
+				if (!inputstart && (ev.type == KeyPress || ev.type == ButtonPress)) {
+					inputstart = t0;
+					inputtime = ev.type == KeyPress ? ev.xkey.time : ev.xbutton.time;
+				}
+			}
+		}
+		if (!running)
+			break;
+		drew = flushbatch();
+		if (debug)
+			drw_sync(drw);
+		else
+			XFlush(dpy);
+		if (drew && inputstart) {
+			t0 = nsnow();
+			hist_add(&stats.input, t0 - inputstart);
+			/* X servers on Linux stamp events with CLOCK_MONOTONIC
+			 * milliseconds, skip timestamps from other clocks */
+			if ((uint32_t)(t0 / 1000000 - inputtime) < 10000)
+				hist_add(&stats.eventage, (uint32_t)(t0 / 1000000 - inputtime) * 1000000ULL);
+		}
+		inputstart = 0;
+		/* the frame drawn in setup is not on screen yet */
+		if (firstframe < 0 && drew) {
+			firstframe = msince(&starttime);
+			firstsyncs = drw->syncs;
+			phase("first frame");
+		}
+		/* flushing may have read more events */
+		if (XQLength(dpy))
+			continue;
+
+		if (poll(pfd, LENGTH(pfd), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll:");
+		}
+		if (pfd[PollClock].revents & POLLIN) {
+			/* fails with ECANCELED if the clock was set */
+			if (read(clockfd, &expirations, sizeof(expirations)) < 0 &&
+			    errno != EAGAIN && errno != ECANCELED)
+				die("read:");
+			armclock();
+			redraw = 1;
+		}
+		if (pfd[PollView].revents & (POLLIN | POLLHUP)) {
+			/* bounded, so a fast writer cannot starve X events */
+			for (i = 0; i < 16 && (n = view_read(view)) > 0; i++)
+				;
+			if (view->eof)
+				pfd[PollView].fd = -1;
+			viewdirty = redraw = 1;
+		}
+		if (pfd[PollIndex].revents & POLLIN) {
+			/* the content only changes if its end was visible */
+			nlines = view->first + view->lines;
+			if (view_update(view))
+				nlines = 0;
+			if (follow)
+				top = -1;
+			if (follow || top + (size_t)MAX(winy / (int)drw->fonts->h, 1) >= nlines)
+				viewdirty = 1;
+			redraw = 1;
+		}
+		if (pfd[PollFeed].revents & (POLLIN | POLLHUP)) {
+			if (readfeed())
+				feedpending = 1;
+			pfd[PollFeed].fd = feedfd;
+			/* render at once if the last feed frame is old enough,
+			 * later records replace this one until the timer fires */
+			if (feedpending && !framearmed) {
+				t0 = feedframe + 1000000000 / maxfps;
+				its.it_value.tv_sec = t0 / 1000000000;
+				its.it_value.tv_nsec = t0 % 1000000000;
+				if (timerfd_settime(framefd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+					die("timerfd_settime:");
+				framearmed = 1;
+			}
+		}
+		if (pfd[PollFrame].revents & POLLIN) {
+			if (read(framefd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+				die("read:");
+			framearmed = 0;
+			if (feedpending) {
+				feedpending = 0;
+				feedframe = nsnow();
+				feedframes++;
+				redraw = 1;
+			}
+		}
+		if (pfd[PollStats].revents & POLLIN) {
+			if (read(statsfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+				die("read:");
+			statsline(stderr);
+		}
+		if (pfd[PollSignal].revents & POLLIN) {
+			while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+				;
+			dumptrace();
+		}
 	}
 }
 
@@ -185,17 +834,19 @@ xhints(void)
 	XFree(sizeh);
 }
 
+/* Map the window as early as possible, only the first font is needed before
+ * the first frame. */
 void
 setup(void)
 {
 	XTextProperty prop;
 	XSetWindowAttributes attrs;
-	unsigned int i;
 	Visual *visual;
 	int screen;
 
 	if (!(dpy = XOpenDisplay(NULL)))
 		die("xwindow: Unable to open display");
+	phase("connect");
 
 	/* init screen */
 	screen = XDefaultScreen(dpy);
@@ -208,7 +859,7 @@ setup(void)
 
 	attrs.bit_gravity = CenterGravity;
 	attrs.event_mask = KeyPressMask | ExposureMask | StructureNotifyMask |
-	                      ButtonMotionMask | ButtonPressMask;
+	                      ButtonPressMask;
 
 	/* init window */
 	win = XCreateWindow(dpy, XRootWindow(dpy, screen), 0, 0,
@@ -216,106 +867,375 @@ setup(void)
 		visual, CWBitGravity | CWEventMask, &attrs);
 
 	/* init atoms */
-	atoms[WMDelete] = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
-	atoms[WMName]   = XInternAtom(dpy, "_NET_WM_NAME", False);
+	if (!XInternAtoms(dpy, atomnames, WMLast, False, atoms))
+		die("xwindow: Unable to intern atoms");
 	XSetWMProtocols(dpy, win, &atoms[WMDelete], 1);
+	phase("window");
+
+	/* init bindings */
+	checkbindings();
+	updatebindings();
+	phase("bindings");
 
 	/* init drw */
-	if (!(drw = drw_create(dpy, screen, win, winw, winh)))
+	/* the backing pixmap is sized to the bar once the font is known */
+	if (!(drw = drw_create(dpy, screen, win, winw, 1)))
 		die("xwindow: Unable to create drawing context");
+	if (useshm)
+		drw_useshm(drw);
+	phase("drw");
+	initcolors();
+	XSetWindowBackground(dpy, win, scheme[SchemeNorm][ColBg].pixel);
+	phase("colors");
+
+	XStringListToTextProperty(&argv0, 1, &prop);
+	XSetWMName(dpy, win, &prop);
+	XSetTextProperty(dpy, win, &prop, atoms[WMName]);
+	XFree(prop.value);
+	xhints();
+	XMapWindow(dpy, win);
+	XFlush(dpy);
+	phase("map");
+
+	initfonts();
+	phase("fonts");
+	drawbar();
+	phase("bar");
+
+	/* init clock */
+	if ((clockfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		die("timerfd_create:");
+	clockinterval = fmtinterval(timefmt);
+	armclock();
+	phase("clock");
+
+	/* init feed frame timer */
+	if (feedfd >= 0 && (framefd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		die("timerfd_create:");
+
+	/* init stats line */
+	if (statsinterval) {
+		struct itimerspec its = {
+			.it_interval = { .tv_sec = statsinterval },
+			.it_value = { .tv_sec = statsinterval },
+		};
+
+		if ((statsfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+		    timerfd_settime(statsfd, 0, &its, NULL) < 0)
+			die("timerfd:");
+	}
+
+#ifdef TRACE
+	/* init trace dumps */
+	if (tracefile) {
+		sigset_t mask;
+
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGUSR1);
+		if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0 ||
+		    (sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+			die("signalfd:");
+	}
+#endif
+}
+
+void
+initcolors(void)
+{
+	unsigned int i;
 
-	/* init appearance */
 	scheme = ecalloc(LENGTH(colors), sizeof(Clr *));
 	for (i = 0; i < LENGTH(colors); i++)
 		scheme[i] = drw_scm_create(drw, colors[i], 2);
-	XSetWindowBackground(dpy, win, scheme[SchemeNorm][ColBg].pixel);
+}
 
-	/* init fonts */
+/* Load the fonts and size the backing store to the bar. */
+void
+initfonts(void)
+{
+	drw_setfallbacklimit(drw, fallbackfonts, fallbackmem);
 	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
 		die("no fonts could be loaded.");
 	lrpad = drw->fonts->h;
 
-	/* init bar */
+	/* init bar, content needs a backing store for the whole window */
 	bh = drw->fonts->h + 2; /* two pixel padding */
+	drw_resize(drw, winw, view ? winh : bh);
+}
+
+/* Set up drawing into memory, for running without an X server. */
+void
+setupmem(void)
+{
+	winw = winwidth;
+	winh = winheight;
+	if (!(drw = drw_create_mem(winw, 1)))
+		die("xwindow: Unable to create drawing context");
+	initcolors();
+	initfonts();
+	if (!view)
+		winh = bh;
+}
+
+/* Render one frame without an X server and write it as PPM. */
+void
+renderppm(const char *path)
+{
+	FILE *fp;
+	uint64_t t0;
+	unsigned int i;
+	int n, ms;
+
+	setupmem();
+	/* a stream is rendered as it is at its end */
+	while (view && !view->eof) {
+		struct pollfd pfd = { .fd = view->fd, .events = POLLIN };
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			die("poll:");
+		while (view_read(view) > 0)
+			;
+	}
+	/* what the feed has now or within 100 ms, a feed may never end */
+	for (t0 = nsnow(); feedfd >= 0 && (ms = 100 - (int)((nsnow() - t0) / 1000000)) > 0; ) {
+		struct pollfd pfd = { .fd = feedfd, .events = POLLIN };
+
+		if ((n = poll(&pfd, 1, ms)) < 0 && errno != EINTR)
+			die("poll:");
+		if (!n)
+			break;
+		readfeed();
+	}
+	viewdirty = 1;
+	drawview();
 	drawbar();
 
-	XStringListToTextProperty(&argv0, 1, &prop);
-	XSetWMName(dpy, win, &prop);
-	XSetTextProperty(dpy, win, &prop, atoms[WMName]);
-	XFree(prop.value);
-	XMapWindow(dpy, win);
-	xhints();
+	if (!(fp = fopen(path, "wb")))
+		die("fopen '%s':", path);
+	if (drw_dump(drw, fp) < 0 || fclose(fp) == EOF)
+		die("cannot write '%s'", path);
+
+	if (debug)
+		drw_stats(drw, stderr);
+	for (i = 0; i < LENGTH(colors); i++)
+		free(scheme[i]);
+	free(scheme);
+	drw_free(drw);
 }
 
+/* Replay the resizes and exposes of a trace without an X server, as fast as
+ * possible. The events between two frames of the trace were one batch, so
+ * this measures what the coalescing in flushbatch leaves to render. Input
+ * events are skipped, their bindings need a display. */
 void
-buttonpress(XEvent *e)
+replay(const char *path)
 {
+	FILE *fp;
+	TraceHdr hdr;
+	TraceRec rec;
+	XEvent ev;
+	uint64_t t0, t;
+	unsigned long nevents = 0, batches = 0, nframes = 0;
 	unsigned int i;
+	int pending = 0;
 
-	printf("\tmouse 'Button%d'\n", e->xbutton.button);
+	if (!(fp = fopen(path, "rb")))
+		die("fopen '%s':", path);
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC ||
+	    hdr.version != TRACE_VERSION || hdr.recsize != sizeof(TraceRec))
+		die("xwindow: '%s' is not a trace", path);
+	setupmem();
+	flushbatch();
+
+	t0 = nsnow();
+	for (i = 0; i < hdr.count && fread(&rec, sizeof(rec), 1, fp) == 1; i++) {
+		memset(&ev, 0, sizeof(ev));
+		switch (rec.type) {
+		case ConfigureNotify:
+			ev.xconfigure.type = ConfigureNotify;
+			ev.xconfigure.width = rec.arg >> 16;
+			ev.xconfigure.height = rec.arg & 0xffff;
+			break;
+		case Expose:
+			ev.xexpose.type = Expose;
+			ev.xexpose.x = rec.pos >> 16;
+			ev.xexpose.y = rec.pos & 0xffff;
+			ev.xexpose.width = rec.arg >> 16;
+			ev.xexpose.height = rec.arg & 0xffff;
+			break;
+		case TraceDraw:
+			batches++;
+			nframes += flushbatch();
+			pending = 0;
+			continue;
+		default:
+			continue;
+		}
+		t = nsnow();
+		handler[ev.type](&ev);
+		hist_add(&stats.handler[ev.type], nsnow() - t);
+		nevents++;
+		pending = 1;
+	}
+	if (pending) {
+		batches++;
+		nframes += flushbatch();
+	}
+	t = nsnow() - t0;
+	fclose(fp);
+
+	printf("replay: %lu events, %lu batches, %lu resizes, %lu frames, %.3f ms\n",
+	       nevents, batches, resizes, nframes, t / 1e6);
+	printf("%-16s %8s %10s %10s %10s %10s %10s\n",
+	       "time in us", "count", "mean", "p50", "p90", "p99", "max");
+	hist_print(&stats.handler[ConfigureNotify], "ConfigureNotify", 1e3, stdout);
+	hist_print(&stats.handler[Expose], "Expose", 1e3, stdout);
+	hist_print(&stats.render, "render", 1e3, stdout);
+
+	for (i = 0; i < LENGTH(colors); i++)
+		free(scheme[i]);
+	free(scheme);
+	drw_free(drw);
+}
+
+/* Map keycodes and buttons to their shortcuts, so dispatching an event is a
+ * table lookup. Only the first of several bindings of a key is kept, the
+ * others are reported. */
+void
+updatebindings(void)
+{
+	unsigned int i;
+	int kc, minkc, maxkc;
+	KeySym sym;
+
+	memset(keys, 0, sizeof(keys));
+	memset(buttons, 0, sizeof(buttons));
+	XDisplayKeycodes(dpy, &minkc, &maxkc);
+	for (kc = minkc; kc <= maxkc && kc < (int)LENGTH(keys); kc++) {
+		if (!(sym = XkbKeycodeToKeysym(dpy, kc, 0, 0)))
+			continue;
+		for (i = 0; i < LENGTH(shortcuts) && !keys[kc]; i++)
+			if (shortcuts[i].keysym == sym && shortcuts[i].func)
+				keys[kc] = &shortcuts[i];
+	}
 	for (i = 0; i < LENGTH(mshortcuts); i++)
-		if (e->xbutton.button == mshortcuts[i].b && mshortcuts[i].func)
-			mshortcuts[i].func(&(mshortcuts[i].arg));
+		if (mshortcuts[i].b < LENGTH(buttons) && !buttons[mshortcuts[i].b] && mshortcuts[i].func)
+			buttons[mshortcuts[i].b] = &mshortcuts[i];
+}
+
+/* The compiler cannot check the binding tables, report duplicates once at
+ * startup instead. */
+void
+checkbindings(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < LENGTH(shortcuts); i++)
+		for (j = 0; j < i; j++)
+			if (shortcuts[i].keysym == shortcuts[j].keysym)
+				fprintf(stderr, "xwindow: duplicate shortcut for key '%s', using the first\n",
+				        XKeysymToString(shortcuts[i].keysym));
+	for (i = 0; i < LENGTH(mshortcuts); i++)
+		for (j = 0; j < i; j++)
+			if (mshortcuts[i].b == mshortcuts[j].b)
+				fprintf(stderr, "xwindow: duplicate shortcut for button %u, using the first\n",
+				        mshortcuts[i].b);
+}
+
+void
+buttonpress(XEvent *e)
+{
+	const Mousekey *m;
+
+	if (e->xbutton.button < LENGTH(buttons) && (m = buttons[e->xbutton.button]))
+		m->func(&m->arg);
 }
 
 void
 clientmessage(XEvent *e)
 {
-	printf("XEVENT ClientMessage\n");
-	if (e->xclient.data.l[0] == atoms[WMDelete]) {
-		printf("Handling ClientMessage, closing window..\n");
+	if (e->xclient.data.l[0] == atoms[WMDelete])
 		running = 0;
-	}
 }
 
 void
 expose(XEvent *e)
 {
-	printf("XEVENT Expose\n");
-	if (0 == e->xexpose.count) {
-		printf("Handling expose '%d'\n", e->xexpose.count);
-		XClearWindow(dpy, win);
-		drawbar();
-	}
+	XExposeEvent *ev = &e->xexpose;
+
+	/* the server paints the background, only the bar needs copying */
+	exposearea(ev->x, ev->y, ev->width, ev->height);
 }
 
 void
 keypress(XEvent *e)
 {
-	unsigned int i;
-	KeySym sym;
+	const Shortcut *k;
 
-	sym = XkbKeycodeToKeysym(dpy, (KeyCode)e->xkey.keycode, 0, 0);
-	printf("\tkeypress '%s'\n", XKeysymToString(sym));
-	for (i = 0; i < LENGTH(shortcuts); i++)
-		if (sym == shortcuts[i].keysym && shortcuts[i].func)
-			shortcuts[i].func(&(shortcuts[i].arg));
+	if (e->xkey.keycode < LENGTH(keys) && (k = keys[e->xkey.keycode]))
+		k->func(&k->arg);
 }
 
 void
 configurenotify(XEvent *e)
 {
 	XConfigureEvent *ev = &e->xconfigure;
-	printf("Configure\n");
 
 	if (winw != ev->width || winh != ev->height) {
-		printf("Handling configurenotify (width: '%d', height: '%d')\n", ev->width, ev->height);
 		winw = ev->width;
 		winh = ev->height;
-		drw_resize(drw, winw, winh);
+		resized = 1;
 	}
 }
 
+void
+mappingnotify(XEvent *e)
+{
+	XMappingEvent *ev = &e->xmapping;
+
+	XRefreshKeyboardMapping(ev);
+	if (ev->request == MappingKeyboard)
+		updatebindings();
+}
+
 void
 usage(void)
 {
-	die("usage: %s [file]", argv0);
+	die("usage: %s [-dSTv] [-f feed] [-o file.ppm] [-r file.trace] [-t file.trace] [file]", argv0);
 }
 
 int
 main(int argc, char *argv[])
 {
+	char *ppm = NULL, *feedpath = NULL, *trace = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &starttime);
 	ARGBEGIN {
+	case 'd':
+		debug = 1;
+		break;
+	case 'S':
+		showstats = 1;
+		break;
+	case 'T':
+		timing = 1;
+		break;
+	case 't':
+#ifdef TRACE
+		tracefile = EARGF(usage());
+#else
+		die("xwindow: built without tracing");
+#endif
+		break;
+	case 'f':
+		feedpath = EARGF(usage());
+		break;
+	case 'o':
+		ppm = EARGF(usage());
+		break;
+	case 'r':
+		trace = EARGF(usage());
+		break;
 	case 'v':
 		die("xwindow-"VERSION);
 		break;
@@ -324,9 +1244,41 @@ main(int argc, char *argv[])
 		break;
 	} ARGEND
 
+	if (argc > 1)
+		usage();
+	if (argc)
+		view = view_open(argv[0], streammax);
+	if (feedpath) {
+		struct stat st;
+
+		if (!strcmp(feedpath, "-")) {
+			if (view && view->fd == STDIN_FILENO)
+				die("xwindow: the feed and the file cannot both be stdin");
+			feedfd = STDIN_FILENO;
+		} else {
+			/* a fifo is opened read-write, so it does not end when a
+			 * writer goes away, nor block until one comes */
+			if (stat(feedpath, &st) < 0 ||
+			    (feedfd = open(feedpath, S_ISFIFO(st.st_mode) ? O_RDWR : O_RDONLY)) < 0)
+				die("open '%s':", feedpath);
+		}
+		if (fcntl(feedfd, F_SETFL, fcntl(feedfd, F_GETFL) | O_NONBLOCK) < 0)
+			die("fcntl:");
+	}
+	if (ppm) {
+		renderppm(ppm);
+		return EXIT_SUCCESS;
+	}
+	if (trace) {
+		replay(trace);
+		return EXIT_SUCCESS;
+	}
+	if (view)
+		indexfd = view_start(view);
 	setup();
 	run();
 	cleanup();
+	view_close(view);
 
 	return EXIT_SUCCESS;
 }